@@ -1,106 +1,195 @@
-#include <Arduino.h>
-#include <SdFat.h>
+#if !defined(__AVR__)
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "hal.h"
 #include "avr11.h"
-#include "rk05.h"
-#include "cons.h"
 #include "unibus.h"
 #include "cpu.h"
-#include "xmem.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+#include "kw11.h"
+#include "jit.h"
+#include "prof.h"
+#include "replay.h"
 
-int serialWrite(char c, FILE *f) {
-  Serial.write(c);
-  return 0;
-}
+#if defined(__AVR__)
+machine machine0;
 
-SdFat sd;
+// the AVR only has machine0, m always points at it.
+void machine::bind() {
+}
+#else
+__thread machine *m;
 
-void setup(void)
-{
-  // setup all the SPI pins, ensure all the devices are deselected
-  pinMode(4, OUTPUT); digitalWrite(4, HIGH);
-  pinMode(10, OUTPUT); digitalWrite(10, HIGH);
-  pinMode(13, OUTPUT); digitalWrite(13, LOW);  // rk11
-  pinMode(53, OUTPUT); digitalWrite(53, HIGH);
-  pinMode(18, OUTPUT); digitalWrite(18, LOW); // timing interrupt, high while CPU is stepping
+machine *newmachine() {
+  void *p = mmap(NULL, sizeof(machine), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+  machine *mc = (machine *)p;
+  mc->mapgen[0] = 1;
+  mc->mapgen[1] = 1;
+  mc->forkfd = -1;
+  mmu::spaces(mc);
+  return mc;
+}
 
-  // Start the UART
-  Serial.begin(19200) ;
-  fdevopen(serialWrite, NULL);
+// freemachine unmaps the machine as a whole, RAM included, whether it
+// is its memfd or mapped copy on write.
+void freemachine(machine *mc) {
+  mmu::dropspaces(mc);
+  jit::release(mc);
+  hal::diskfree(mc);
+  if (mc->forkfd >= 0) {
+    close(mc->forkfd);
+  }
+  munmap(mc, sizeof(machine));
+}
 
-  Serial.println(F("Reset"));
+void machine::bind() {
+  m = this;
+  hal::ram = ram;
+}
+#endif
 
-  // Xmem test
-  xmem::SelfTestResults results;
+void setup(void)
+{
+  hal::begin();
+#if !defined(__AVR__)
+  machine *mc = newmachine();
+  if (!mc) {
+    xprintf("allocating the machine failed\r\n");
+    hal::halt();
+  }
+  mc->bind();
+  hal::console(mc);
+#endif
 
-  xmem::begin(false);
-  results = xmem::selfTest();
-  if (!results.succeeded) {
-    Serial.println(F("xram test failure"));
+  if (!hal::diskopen("boot1.RK0")) {
+    xprintf("opening boot1.RK0 for write failed\r\n");
     panic();
   }
 
-  // Initialize SdFat or print a detailed error message and halt
-  // Use half speed like the native library.
-  // change to SPI_FULL_SPEED for more performance.
-  if (!sd.begin(4, SPI_FULL_SPEED)) sd.initErrorHalt();
-  if (!rk11::rkdata.open("boot1.RK0", O_RDWR )) {
-    sd.errorHalt("opening boot1.RK0 for write failed");
-  }
+  m->reset();
+  xprintf("Ready\r\n");
+}
 
+void machine::reset() {
+  bind();
   cpu::reset();
-  Serial.println(F("Ready"));
+  if (ENABLE_LKS) {
+    event::schedule(event::CLOCK, kw11::TICK);
+  }
 }
 
-union {
-  struct {
-    uint8_t low;
-    uint8_t high;
-  } bytes;
-  uint16_t value;
-} clkcounter;
-uint16_t instcounter;
+// fire calls the tick handlers of the devices whose events are due.
+void machine::fire() {
+  uint8_t ev;
+  while ((ev = event::take()) != event::N) {
+    unibus::tick(ev);
+  }
+}
 
-// On a 16Mhz atmega 2560 this loop costs 21usec per emulated instruction
-// This cost is just the cost of the loop and fetching the instruction at the PC.
-// Actual emulation of the instruction is another ~40 usec per instruction.
-static void loop0() {
+// idle fast-forwards a CPU in WAIT to the next interrupt. While console
+// output or a disk transfer is in progress time jumps from event to
+// event. Otherwise the host blocks until the next clock tick is due or
+// a character arrives, unless a replay says when that was.
+void machine::idle() {
   for (;;) {
-    //the itab check is very cheap
-    if ((itab[0].vec) && (itab[0].pri >= ((cpu::PS >> 5) & 7))) {
-      cpu::handleinterrupt();
-      return; // exit from loop to reset trapbuf
+    fire();
+    if (cpu::interruptdue()) {
+      waiting = false;
+      return;
     }
-       
-    digitalWrite(18, HIGH);
-    cpu::step();
-    digitalWrite(18, LOW);
-    
-    if (ENABLE_LKS) {
-      ++clkcounter.value;
-      if (clkcounter.bytes.high == 1 << 6) {
-        clkcounter.value = 0;
-        cpu::LKS |= (1 << 7);
-        if (cpu::LKS & (1 << 6)) {
-          cpu::interrupt(INTCLOCK, 6);
-        }
+    if (pending & ((1 << event::TTYOUT) | (1 << event::RK))) {
+      now += event::next();
+      continue;
+    }
+    uint32_t left = kw11::TICK;
+    if (pending & (1 << event::CLOCK)) {
+      left = due[event::CLOCK] - now;
+    }
+    uint32_t n = left;
+    if (replay::playing()) {
+      n = replay::wake(left);
+    } else {
+      const uint32_t us = left * kw11::TICKUSEC / kw11::TICK;
+      const uint32_t slept = hal::idle(us);
+      if (slept < us) {
+        n = slept * kw11::TICK / kw11::TICKUSEC;
       }
     }
-    // costs 3 usec
-    cons::poll();
+    now += n;
+    if (n < left) {
+      replay::woke();
+      event::schedule(event::TTYIN, 0);
+    }
+  }
+}
+
+// run emulates up to budget instructions. The CPU runs until the next
+// event is due, only stopping early to take an interrupt or a trap, or
+// after an instruction that schedules an event. A CPU in WAIT, even one
+// that was left waiting by the last call, idles the host until its next
+// interrupt.
+runstats machine::run(const uint32_t budget) {
+  bind();
+  const uint32_t traps0 = traps;
+  const uint32_t interrupts0 = interrupts;
+  uint32_t done = 0;
+  while (done < budget) {
+    fire();
+    if (cpu::interruptdue()) {
+      cpu::handleinterrupt();
+      continue;
+    }
+    if (waiting) {
+      idle();
+      continue;
+    }
+    uint32_t max = event::next();
+    if (budget - done < max) {
+      max = budget - done;
+    }
+    if (max > 0xFFFF) {
+      max = 0xFFFF;
+    }
+    scheduled = 0;
+    hal::stepled(true);
+    const uint16_t n = cpu::run(max);
+    hal::stepled(false);
+    event::ran(n);
+    cpu::taketraps();
+    done += n;
   }
+  const runstats s = { done, traps - traps0, interrupts - interrupts0 };
+  return s;
 }
 
-jmp_buf trapbuf;
+void machine::loop() {
+  for (;;) {
+    run(0xFFFFFFFF);
+  }
+}
 
 void loop() {
-  uint16_t vec = setjmp(trapbuf);
-  if (vec) {
-    cpu::trapat(vec);
-  }
-  loop0();
+  m->loop();
 }
 
 void panic() {
   printstate();
-  for (;;) delay(1);
+#if !defined(__AVR__)
+  if (FUSESTATS) {
+    cpu::fusereport();
+  }
+  if (TLBSTATS) {
+    mmu::tlbreport();
+  }
+  if (PROFILE) {
+    prof::report();
+  }
+#endif
+  hal::halt();
 }
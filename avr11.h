@@ -1,14 +1,11 @@
-// interrupts
+// trap vectors, the devices' interrupt vectors are in DEVICES, see
+// unibus.h.
 enum {
   INTBUS    = 0004,
   INTINVAL  = 0010,
   INTDEBUG  = 0014,
   INTIOT    = 0020,
-  INTTTYIN  = 0060,
-  INTTTYOUT = 0064,
-  INTFAULT  = 0250,
-  INTCLOCK  = 0100,
-  INTRK     = 0220
+  INTFAULT  = 0250
 };
 
 enum {
@@ -18,12 +15,20 @@ enum {
   DEBUG_RK05 = false,
   DEBUG_MMU = false,
   ENABLE_LKS = true,
+  THREADED = true,   // run translated blocks, host only
+  JIT = true,        // compile hot blocks to x86-64, host only
+  PERFMAP = true,    // describe compiled blocks in /tmp/perf-<pid>.map
+  FUSESTATS = false, // count superinstructions, reported by panic
+  TLBSTATS = false,  // count MMU TLB hits, misses and faults, reported by panic
+  PROFILE = false,   // count instructions by opcode and PC, host only, see prof.h
+  TRACE = false,     // record every instruction in a binary trace, host only, see trace.h
+  TRACEFILE = true,  // keep the trace in /tmp/avr11-<pid>.trace
+  PDP1170 = false,   // 11/70 MMU: 22 bit addresses, SR3, I/D space and the UNIBUS map, host only
 };
 
 void printstate();
-void panic();
+void panic() __attribute__((noreturn));
 void disasm(uint32_t ia);
-
-void trap(uint16_t num);
-
-
+// disasm prints the instruction at ia, reading it and the words after
+// it with read.
+void disasm(uint32_t ia, uint16_t (*read)(uint32_t));
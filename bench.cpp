@@ -0,0 +1,71 @@
+#if !defined(__AVR__)
+
+#include <time.h>
+#include "hal.h"
+#include "avr11.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+#include "unibus.h"
+#include "bench.h"
+#include "benchmarks.h"
+
+namespace bench {
+
+struct benchmark {
+  const char *name;
+  const uint16_t *code;
+  uint16_t len;
+};
+
+#define BENCH(name, code) { name, code, sizeof(code) / sizeof(code[0]) }
+
+static const benchmark benchmarks[] = {
+  BENCH("mov", benchmov),
+  BENCH("modes", benchmodes),
+  BENCH("branch", benchbranch),
+  BENCH("eis", bencheis),
+  BENCH("mmuoff", benchmmuoff),
+  BENCH("mmuon", benchmmuon),
+  BENCH("trap", benchtrap),
+  BENCH("io", benchio),
+};
+
+// Each benchmark runs WARMUP instructions, so its loop has been
+// translated, then RUN instructions timed.
+enum { START = 01000, WARMUP = 1000000, RUN = 50000000 };
+
+static uint64_t nsec() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+int run() {
+  printf("%-8s %14s %10s\n", "bench", "instr/s", "ns/instr");
+  for (uint8_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    const benchmark &b = benchmarks[i];
+    machine *mc = newmachine();
+    if (!mc) {
+      fprintf(stderr, "allocating the machine failed\n");
+      return 1;
+    }
+    mc->reset();
+    for (uint16_t j = 0; j < b.len; j++) {
+      unibus::write16(START + 2 * j, b.code[j]);
+    }
+    mc->R[7] = START;
+    mc->run(WARMUP);
+    const uint64_t start = nsec();
+    const runstats s = mc->run(RUN);
+    const uint64_t ns = nsec() - start;
+    printf("%-8s %14.0f %10.2f\n", b.name, s.instructions * 1e9 / ns, (double)ns / s.instructions);
+    freemachine(mc);
+  }
+  return 0;
+}
+
+};
+
+#endif
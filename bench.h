@@ -0,0 +1,16 @@
+// bench times small guest programs that each stress one path through
+// the emulator, register MOVs, the addressing modes, branches, EIS, the
+// MMU, traps and the I/O page, see benchmarks.h.
+
+#if !defined(__AVR__)
+
+namespace bench {
+
+// run runs each benchmark, prints the instructions it emulated per
+// second and the host time per instruction, and returns the exit status
+// for main.
+int run();
+
+};
+
+#endif
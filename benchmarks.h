@@ -0,0 +1,136 @@
+// benchmarks are the programs bench::run times, see bench.cpp. Each is
+// loaded at 01000, as the bootrom is at 02000, and loops forever
+// stressing one path through the emulator.
+
+// register to register MOVs
+static const uint16_t benchmov[] = {
+  0012706, 0001000, /* MOV #1000, SP */
+  0010001, /* loop: MOV R0, R1 */
+  0010102, /* MOV R1, R2 */
+  0010203, /* MOV R2, R3 */
+  0010304, /* MOV R3, R4 */
+  0010405, /* MOV R4, R5 */
+  0010500, /* MOV R5, R0 */
+  0005200, /* INC R0 */
+  0000770, /* BR loop */
+};
+
+// each addressing mode as source and destination
+static const uint16_t benchmodes[] = {
+  0012706, 0001000, /* MOV #1000, SP */
+  0012737, 0004000, 0004010, /* MOV #4000, @#4010 */
+  0012700, 0004000, /* loop: MOV #4000, R0 */
+  0012702, 0004010, /* MOV #4010, R2 */
+  0011001, /* MOV (R0), R1 */
+  0012001, /* MOV (R0)+, R1 */
+  0014001, /* MOV -(R0), R1 */
+  0013201, /* MOV @(R2)+, R1 */
+  0015201, /* MOV @-(R2), R1 */
+  0016001, 0000002, /* MOV 2(R0), R1 */
+  0017001, 0000010, /* MOV @10(R0), R1 */
+  0012701, 0000007, /* MOV #7, R1 */
+  0013701, 0004000, /* MOV @#4000, R1 */
+  0016701, 0002720, /* MOV 4000, R1 */
+  0017701, 0002724, /* MOV @4010, R1 */
+  0010110, /* MOV R1, (R0) */
+  0010120, /* MOV R1, (R0)+ */
+  0010140, /* MOV R1, -(R0) */
+  0010160, 0000002, /* MOV R1, 2(R0) */
+  0010137, 0004002, /* MOV R1, @#4002 */
+  0000743, /* BR loop */
+};
+
+// conditional branches, taken and not, and SOB
+static const uint16_t benchbranch[] = {
+  0012706, 0001000, /* MOV #1000, SP */
+  0012700, 0000010, /* loop: MOV #10, R0 */
+  0020027, 0000004, /* next: CMP R0, #4 */
+  0003402, /* BLE low */
+  0005701, /* TST R1 */
+  0000401, /* BR test */
+  0005001, /* low: CLR R1 */
+  0001001, /* test: BNE odd */
+  0005201, /* INC R1 */
+  0003001, /* odd: BGT down */
+  0005301, /* DEC R1 */
+  0077013, /* down: SOB R0, next */
+  0000762, /* BR loop */
+};
+
+// EIS MUL, DIV, ASH and ASHC
+static const uint16_t bencheis[] = {
+  0012706, 0001000, /* MOV #1000, SP */
+  0012700, 0001234, /* loop: MOV #1234, R0 */
+  0070027, 0000007, /* MUL #7, R0 */
+  0071027, 0000007, /* DIV #7, R0 */
+  0012702, 0001234, /* MOV #1234, R2 */
+  0072227, 0000003, /* ASH #3, R2 */
+  0072227, 0177775, /* ASH #-3, R2 */
+  0073227, 0000005, /* ASHC #5, R2 */
+  0073227, 0177773, /* ASHC #-5, R2 */
+  0000757, /* BR loop */
+};
+
+// memory reads and writes with the MMU off
+static const uint16_t benchmmuoff[] = {
+  0012706, 0001000, /* MOV #1000, SP */
+  0012700, 0172340, /* MOV #KIPAR0, R0 */
+  0012701, 0172300, /* MOV #KIPDR0, R1 */
+  0005002, /* CLR R2 */
+  0012703, 0000010, /* MOV #10, R3 */
+  0010220, /* map: MOV R2, (R0)+ */
+  0012721, 0077406, /* MOV #77406, (R1)+ */
+  0062702, 0000200, /* ADD #200, R2 */
+  0077306, /* SOB R3, map */
+  0012737, 0007600, 0172356, /* MOV #7600, @#KIPAR7 */
+  0012700, 0004000, /* loop: MOV #4000, R0 */
+  0012702, 0000040, /* MOV #40, R2 */
+  0062001, /* sum: ADD (R0)+, R1 */
+  0010140, /* MOV R1, -(R0) */
+  0005720, /* TST (R0)+ */
+  0077204, /* SOB R2, sum */
+  0000767, /* BR loop */
+};
+
+// the same with the MMU on, mapping kernel space 1:1
+static const uint16_t benchmmuon[] = {
+  0012706, 0001000, /* MOV #1000, SP */
+  0012700, 0172340, /* MOV #KIPAR0, R0 */
+  0012701, 0172300, /* MOV #KIPDR0, R1 */
+  0005002, /* CLR R2 */
+  0012703, 0000010, /* MOV #10, R3 */
+  0010220, /* map: MOV R2, (R0)+ */
+  0012721, 0077406, /* MOV #77406, (R1)+ */
+  0062702, 0000200, /* ADD #200, R2 */
+  0077306, /* SOB R3, map */
+  0012737, 0007600, 0172356, /* MOV #7600, @#KIPAR7 */
+  0012737, 0000001, 0177572, /* MOV #1, @#SR0 */
+  0012700, 0004000, /* loop: MOV #4000, R0 */
+  0012702, 0000040, /* MOV #40, R2 */
+  0062001, /* sum: ADD (R0)+, R1 */
+  0010140, /* MOV R1, -(R0) */
+  0005720, /* TST (R0)+ */
+  0077204, /* SOB R2, sum */
+  0000767, /* BR loop */
+};
+
+// TRAP and RTI
+static const uint16_t benchtrap[] = {
+  0012706, 0001000, /* MOV #1000, SP */
+  0012737, 0001022, 0000034, /* MOV #handler, @#34 */
+  0005037, 0000036, /* CLR @#36 */
+  0104400, /* loop: TRAP 0 */
+  0000776, /* BR loop */
+  0000002, /* h: RTI */
+};
+
+// I/O page reads and writes
+static const uint16_t benchio[] = {
+  0012706, 0001000, /* MOV #1000, SP */
+  0013700, 0177546, /* loop: MOV @#LKS, R0 */
+  0010037, 0177546, /* MOV R0, @#LKS */
+  0013701, 0177776, /* MOV @#PS, R1 */
+  0013702, 0177572, /* MOV @#SR0, R2 */
+  0013703, 0177564, /* MOV @#TPS, R3 */
+  0000765, /* BR loop */
+};
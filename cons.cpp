@@ -1,57 +1,80 @@
-#include <Arduino.h>
+#include "hal.h"
 #include "avr11.h"
 #include "cons.h"
 #include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+#include "unibus.h"
+#include "prof.h"
+#include "replay.h"
+#include "snapshot.h"
 
 namespace cons {
 
-uint16_t TKS;
-uint16_t TKB;
-uint16_t TPS;
-uint16_t TPB;
+// The host is looked at for input every TTYPOLL instructions. A
+// character written to TPB is output TPDELAY instructions later, about
+// a millisecond, as at 9600 baud.
+enum { TTYPOLL = 128, TPDELAY = 1024 };
 
 void clearterminal() {
-  TKS = 0;
-  TPS = 1 << 7;
-  TKB = 0;
-  TPB = 0;
+  m->TKS = 0;
+  m->TPS = 1 << 7;
+  m->TKB = 0;
+  m->TPB = 0;
+  event::cancel(event::TTYOUT);
+  event::schedule(event::TTYIN, TTYPOLL);
 }
 
 static void addchar(char c) {
   switch (c) {
     case 42:
-      TKB = 4;
+      m->TKB = 4;
       break;
     case 19:
-      TKB = 034;
+      m->TKB = 034;
       break;
       //case 46:
       //	TKB = 127;
     default:
-      TKB = c;
+      m->TKB = c;
       break;
   }
-  TKS |= 0x80;
-  if (TKS & (1 << 6)) {
-    cpu::interrupt(INTTTYIN, 4);
+  m->TKS |= 0x80;
+  if (m->TKS & (1 << 6)) {
+    unibus::interrupt(unibus::TTI);
   }
 }
 
-uint8_t count;
+#if !defined(__AVR__)
+bool hostkey(const uint8_t c) {
+  if (PROFILE && (c == prof::PROFKEY)) {
+    prof::report();
+    return true;
+  }
+  if ((c == snapshot::SNAPKEY) && m->snappath) {
+    snapshot::save();
+    return true;
+  }
+  return false;
+}
+#endif
 
-void poll() {
-  if (Serial.available()) {
-    addchar(Serial.read());
+void receive() {
+  // the next poll is scheduled first, a snapshot taken by hostkey
+  // resumes polling.
+  event::schedule(event::TTYIN, TTYPOLL);
+  const int16_t c = replay::input();
+  if (c >= 0) {
+    addchar(c);
   }
+}
 
-  if ((TPS & 0x80) == 0) {
-    if (++count > 32) {
-      Serial.write(TPB & 0x7f);
-      TPS |= 0x80;
-      if (TPS & (1 << 6)) {
-        cpu::interrupt(INTTTYOUT, 4);
-      }
-    }
+void transmit() {
+  hal::writechar(m->TPB & 0x7f);
+  m->TPS |= 0x80;
+  if (m->TPS & (1 << 6)) {
+    unibus::interrupt(unibus::TTO);
   }
 }
 
@@ -61,19 +84,19 @@ void poll() {
 uint16_t read16(uint32_t a) {
   switch (a) {
     case 0777560:
-      return TKS;
+      return m->TKS;
     case 0777562:
-      if (TKS & 0x80) {
-        TKS &= 0xff7e;
-        return TKB;
+      if (m->TKS & 0x80) {
+        m->TKS &= 0xff7e;
+        return m->TKB;
       }
       return 0;
     case 0777564:
-      return TPS;
+      return m->TPS;
     case 0777566:
       return 0;
     default:
-      Serial.println(F("consread16: read from invalid address")); // " + ostr(a, 6))
+      xprintf("consread16: read from invalid address\r\n"); // " + ostr(a, 6))
       panic();
   }
 }
@@ -82,27 +105,27 @@ void write16(uint32_t a, uint16_t v) {
   switch (a) {
     case 0777560:
       if (v & (1 << 6)) {
-        TKS |= 1 << 6;
+        m->TKS |= 1 << 6;
       }
       else {
-        TKS &= ~(1 << 6);
+        m->TKS &= ~(1 << 6);
       }
       break;
     case 0777564:
       if (v & (1 << 6)) {
-        TPS |= 1 << 6;
+        m->TPS |= 1 << 6;
       }
       else {
-        TPS &= ~(1 << 6);
+        m->TPS &= ~(1 << 6);
       }
       break;
     case 0777566:
-      TPB = v & 0xff;
-      TPS &= 0xff7f;
-      count = 0;
+      m->TPB = v & 0xff;
+      m->TPS &= 0xff7f;
+      event::schedule(event::TTYOUT, TPDELAY);
       break;
     default:
-      Serial.println(F("conswrite16: write to invalid address")); // " + ostr(a, 6))
+      xprintf("conswrite16: write to invalid address\r\n"); // " + ostr(a, 6))
       panic();
   }
 }
@@ -3,6 +3,14 @@ namespace cons {
     void write16(uint32_t a, uint16_t v);
     uint16_t read16(uint32_t a);
     void clearterminal();
-    void poll();
+    // receive and transmit are called when the TTYIN and TTYOUT
+    // events are due.
+    void receive();
+    void transmit();
+#if !defined(__AVR__)
+    // hostkey handles c if it is typed for the host, PROFKEY or
+    // SNAPKEY, rather than for the guest, and reports whether it was.
+    bool hostkey(uint8_t c);
+#endif
 
 };
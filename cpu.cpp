@@ -1,160 +1,306 @@
-#include <SdFat.h>
+#include <string.h>
+#include "hal.h"
 #include "avr11.h"
 #include "mmu.h"
-#include "cons.h"
 #include "unibus.h"
 #include "cpu.h"
+#include "event.h"
+#include "machine.h"
+#include "jit.h"
+#include "prof.h"
+#include "trace.h"
 
 #include "bootrom.h"
-#include "rk05.h"
-
-pdp11::intr itab[ITABN];
+#include "opcodes.h"
 
 namespace cpu {
 
-// signed integer registers
-int32_t R[8];
-
-uint16_t	PS; // processor status
-uint16_t	PC; // address of current instruction
-uint16_t   KSP, USP; // kernel and user stack pointer
-uint16_t LKS;
-bool curuser, prevuser;
-
 void reset(void) {
-  LKS = 1 << 7;
+  m->LKS = 1 << 7;
+  m->waiting = false;
   uint16_t i;
   for (i = 0; i < 29; i++) {
     unibus::write16(02000 + (i * 2), bootrom[i]);
   }
-  R[7] = 02002;
-  cons::clearterminal();
-  rk11::reset();
+  m->R[7] = 02002;
+  unibus::reset();
 }
 
-static uint16_t read8(const uint16_t a) {
-  return unibus::read8(mmu::decode(a, false, curuser));
+uint16_t readreg(const uint32_t a) {
+  if (a == 0777570) {
+    return 0173030;
+  }
+  return psw();
 }
 
-static uint16_t read16(const uint16_t a) {
-  return unibus::read16(mmu::decode(a, false, curuser));
+void writereg(const uint32_t a, const uint16_t v) {
+  if (a == 0777570) {
+    xprintf("cpu::writereg write to read-only switch register\r\n");
+    trap(INTBUS);
+    return;
+  }
+  switch (v >> 14) {
+    case 0:
+      switchmode(false);
+      break;
+    case 3:
+      switchmode(true);
+      break;
+    default:
+      xprintf("invalid mode\r\n");
+      panic();
+  }
+  switch ((v >> 12) & 3) {
+    case 0:
+      m->prevuser = false;
+      break;
+    case 3:
+      m->prevuser = true;
+      break;
+    default:
+      xprintf("invalid mode\r\n");
+      panic();
+  }
+  setpsw(v);
 }
 
-static void write8(const uint16_t a, const uint16_t v) {
-  unibus::write8(mmu::decode(a, true, curuser), v);
+void trap(const uint16_t vec) {
+  if (!m->trapped) {
+    m->trapped = vec;
+  }
+#if !defined(__AVR__)
+  m->exitblock = true;
+#endif
 }
 
-static void write16(const uint16_t a, const uint16_t v) {
-  unibus::write16(mmu::decode(a, true, curuser), v);
+// direct returns where a is in the current address space when it can
+// be read, or written if w, straight from there, see mmu::spaces, or
+// NULL. The trace needs every physical address, so it goes the long way.
+static inline uint8_t *direct(const uint16_t a, const bool w) {
+#if !defined(__AVR__)
+  const uint8_t s = (m->SR0 & 1) ? m->curuser : mmu::OFF;
+  if (!TRACE && ((m->direct[w][s] >> (a >> 13)) & 1)) {
+    return m->space[s] + a;
+  }
+#endif
+  return NULL;
 }
 
-static bool isReg(const uint16_t a) {
-  return (a & 0177770) == 0170000;
+// directpa is the physical address of a, written through direct.
+static inline uint32_t directpa(const uint16_t a) {
+#if !defined(__AVR__)
+  const uint8_t s = (m->SR0 & 1) ? m->curuser : mmu::OFF;
+  return m->spaceoff[s][a >> 13] + (a & 017777);
+#else
+  return a;
+#endif
 }
 
-static uint16_t memread16(const uint16_t a) {
-  if (isReg(a)) {
-    return R[a & 7];
+// The memory accessors return 0, and leave the bus alone, when the
+// virtual address traps.
+static uint16_t read8(const uint16_t a) {
+  const uint8_t *p = direct(a, false);
+  if (p) {
+    return *p;
+  }
+  const uint32_t pa = mmu::decode(a, false, m->curuser, true);
+  if (m->trapped) {
+    return 0;
   }
-  return read16(a);
+  trace::ea(a, pa);
+  return unibus::read8(pa);
 }
 
-static uint16_t memread(uint16_t a, uint8_t l) {
-  if (isReg(a)) {
-    const uint8_t r = a & 7;
-    if (l == 2) {
-      return R[r];
-    }
-    else {
-      return R[r] & 0xFF;
-    }
+static uint16_t read16(const uint16_t a) {
+  const uint8_t *p = direct(a, false);
+  if (p && !(a & 1)) {
+    return *(const uint16_t *)p;
   }
-  if (l == 2) {
-    return read16(a);
+  const uint32_t pa = mmu::decode(a, false, m->curuser, true);
+  if (m->trapped) {
+    return 0;
   }
-  return read8(a);
+  trace::ea(a, pa);
+  return unibus::read16(pa);
 }
 
-static void memwrite16(const uint16_t a, const uint16_t v) {
-  if (isReg(a)) {
-    R[a & 7] = v;
-  } else {
-    write16(a, v);
+static void write8(const uint16_t a, const uint16_t v) {
+  uint8_t *p = direct(a, true);
+  if (p) {
+    *p = v;
+    written(directpa(a));
+    return;
+  }
+  const uint32_t pa = mmu::decode(a, true, m->curuser, true);
+  if (m->trapped) {
+    return;
   }
+  trace::ea(a, pa);
+  unibus::write8(pa, v);
 }
 
-static void memwrite(const uint16_t a, const uint8_t l, const uint16_t v) {
-  if (isReg(a)) {
-    const uint8_t r = a & 7;
-    if (l == 2) {
-      R[r] = v;
-    }
-    else {
-      R[r] &= 0xFF00;
-      R[r] |= v;
-    }
+static void write16(const uint16_t a, const uint16_t v) {
+  uint8_t *p = direct(a, true);
+  if (p && !(a & 1)) {
+    *(uint16_t *)p = v;
+    written(directpa(a));
     return;
   }
-  if (l == 2) {
-    write16(a, v);
+  const uint32_t pa = mmu::decode(a, true, m->curuser, true);
+  if (m->trapped) {
+    return;
   }
-  else {
-    write8(a, v);
+  trace::ea(a, pa);
+  unibus::write16(pa, v);
+}
+
+// iread16 reads the instruction stream, which is in the 11/70's I space
+// when its D space is enabled.
+static uint16_t iread16(const uint16_t a) {
+  if (!mmu::dspace(m->curuser)) {
+    return read16(a);
   }
+  const uint32_t pa = mmu::decode(a, false, m->curuser, false);
+  if (m->trapped) {
+    return 0;
+  }
+  trace::ea(a, pa);
+  return unibus::read16(pa);
 }
 
+// m->lit is NOLIT when no (PC)+ operand has been read.
+enum { NOLIT = 0200000 };
+
 static uint16_t fetch16() {
-  const uint16_t val = read16(R[7]);
-  R[7] += 2;
+  if (m->nimm) {
+    m->nimm--;
+    m->R[7] += 2;
+    return *m->imm++;
+  }
+  const uint16_t val = iread16(m->R[7]);
+  if (m->trapped) {
+    return 0;
+  }
+  m->R[7] += 2;
   return val;
 }
 
 static void push(const uint16_t v) {
-  R[6] -= 2;
-  write16(R[6], v);
+  m->R[6] -= 2;
+  write16(m->R[6], v);
 }
 
 static uint16_t pop() {
-  const uint16_t val = read16(R[6]);
-  R[6] += 2;
+  const uint16_t val = read16(m->R[6]);
+  if (m->trapped) {
+    return 0;
+  }
+  m->R[6] += 2;
   return val;
 }
 
-// aget resolves the operand to a vaddress.
-// if the operand is a register, an address in
-// the range [0170000,0170007). This address range is
-// technically a valid IO page, but unibus doesn't map
-// any addresses here, so we can safely do this.
-static uint16_t aget(uint8_t v, uint8_t l) {
-  if ((v & 070) == 000) {
-    return 0170000 | (v & 7);
+// Operands are accessed through templates specialized on the width L,
+// 1 or 2 bytes, and the addressing mode M, so a handler instantiated
+// for a register operand compiles down to plain register accesses.
+// aget resolves the operand to the register number in mode 0, and to
+// a vaddress in any other mode.
+//
+// An access that traps sets trapped, and the handler must return
+// before it changes any more state, as the instruction is aborted.
+// Only aget in modes 3, 5, 6 and 7 and the memory modes of memread and
+// memwrite can trap, faulted<M> is true when one through mode M has.
+template <uint8_t M>
+static inline bool faulted() {
+  return (M != 0) && m->trapped;
+}
+
+template <uint8_t L, uint8_t M>
+static inline uint16_t aget(const uint8_t v) {
+  const uint8_t r = v & 7;
+  // deferred modes and the SP and PC always step by a word.
+  const uint8_t l = (L == 2 || (M & 1) || r >= 6) ? 2 : 1;
+  uint16_t addr;
+  switch (M) {
+    case 0:
+      return r;
+    case 1:
+      return m->R[r];
+    case 2:
+      addr = m->R[r];
+      if (m->nimm && (r == 7)) {
+        m->nimm--;
+        m->lit = addr;
+        m->litval = *m->imm++;
+      } else if ((r == 7) && mmu::dspace(m->curuser)) {
+        m->lit = addr;
+        m->litval = iread16(addr);
+      }
+      m->R[r] += l;
+      return addr;
+    case 3:
+      if (m->nimm && (r == 7)) {
+        // @#a, the address is the next word.
+        return fetch16();
+      }
+      addr = m->R[r];
+      m->R[r] += 2;
+      return (r == 7) ? iread16(addr) : read16(addr);
+    case 4:
+      m->R[r] -= l;
+      return m->R[r];
+    case 5:
+      m->R[r] -= 2;
+      return read16(m->R[r]);
+    case 6:
+      addr = fetch16();
+      return addr + m->R[r];
+    default:
+      addr = fetch16();
+      if (m->trapped) {
+        return 0;
+      }
+      return read16(addr + m->R[r]);
   }
-  if (((v & 7) >= 6) || (v & 010)) {
-    l = 2;
+}
+
+template <uint8_t L, uint8_t M>
+static inline uint16_t memread(const uint16_t a) {
+  if (M == 0) {
+    return L == 2 ? m->R[a] : m->R[a] & 0xFF;
   }
-  uint16_t addr = 0;
-  switch (v & 060) {
-    case 000:
-      v &= 7;
-      addr = R[v & 7];
-      break;
-    case 020:
-      addr = R[v & 7];
-      R[v & 7] += l;
-      break;
-    case 040:
-      R[v & 7] -= l;
-      addr = R[v & 7];
-      break;
-    case 060:
-      addr = fetch16();
-      addr += R[v & 7];
-      break;
+  if ((M == 3 || M >= 5) && m->trapped) {
+    // a is the result of an aget that trapped.
+    return 0;
+  }
+  // only (PC)+ sets lit.
+  if (M == 2 && a == m->lit) {
+    return L == 2 ? m->litval : m->litval & 0xFF;
   }
-  if (v & 010) {
-    addr = read16(addr);
+  return L == 2 ? read16(a) : read8(a);
+}
+
+template <uint8_t L, uint8_t M>
+static inline void memwrite(const uint16_t a, const uint16_t v) {
+  if (M == 0) {
+    if (L == 2) {
+      m->R[a] = v;
+    }
+    else {
+      m->R[a] &= 0xFF00;
+      m->R[a] |= v;
+    }
+    return;
+  }
+  if ((M == 3 || M >= 5) && m->trapped) {
+    return;
+  }
+  m->lit = NOLIT;
+  if (L == 2) {
+    write16(a, v);
+  }
+  else {
+    write8(a, v);
   }
-  return addr;
 }
 
 static void branch(int16_t o) {
@@ -162,251 +308,352 @@ static void branch(int16_t o) {
     o = -(((~o) + 1) & 0xFF);
   }
   o <<= 1;
-  R[7] += o;
+  m->R[7] += o;
 }
 
 void switchmode(const bool newm) {
-  prevuser = curuser;
-  curuser = newm;
-  if (prevuser) {
-    USP = R[6];
+  m->prevuser = m->curuser;
+  m->curuser = newm;
+  if (m->prevuser) {
+    m->USP = m->R[6];
   }
   else {
-    KSP = R[6];
+    m->KSP = m->R[6];
   }
-  if (curuser) {
-    R[6] = USP;
+  if (m->curuser) {
+    m->R[6] = m->USP;
   }
   else {
-    R[6] = KSP;
+    m->R[6] = m->KSP;
   }
-  PS &= 0007777;
-  if (curuser) {
-    PS |= (1 << 15) | (1 << 14);
+  m->PS &= 0007777;
+  if (m->curuser) {
+    m->PS |= (1 << 15) | (1 << 14);
   }
-  if (prevuser) {
-    PS |= (1 << 13) | (1 << 12);
+  if (m->prevuser) {
+    m->PS |= (1 << 13) | (1 << 12);
   }
 }
 
 static void setZ(bool b) {
    if (b) 
-     PS |= FLAGZ;
+     m->PS |= FLAGZ;
 }
 
-static void MOV(const uint16_t instr) {
-  const uint8_t d = instr & 077;
-  const uint8_t s = (instr & 07700) >> 6;
-  uint8_t l = 2 - (instr >> 15);
-  const uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  uint16_t uval = memread(aget(s, l), l);
-  const uint16_t da = aget(d, l);
-  PS &= 0xFFF1;
-  if (uval & msb) {
-    PS |= FLAGN;
+// The common ALU handlers don't compute the condition codes, they
+// record the kind of operation, its operands and result in cc and
+// psw() works out N, Z, V and C from that when they are needed. Kinds
+// from CCTST on set C, the others leave C as it is in PS.
+
+static inline uint16_t carry(const uint8_t op) {
+  switch (op) {
+    case CCCOM:
+      return FLAGC;
+    case CCNEG:
+      return m->cc.res ? FLAGC : 0;
+    case CCCMP:
+      return m->cc.src < m->cc.dst ? FLAGC : 0;
+    case CCADD:
+      return (m->cc.src + m->cc.dst) >= 0xFFFF ? FLAGC : 0;
+    case CCSUB:
+      return m->cc.src > m->cc.dst ? FLAGC : 0;
+  }
+  return 0;
+}
+
+// keepcarry moves C of the pending operation into PS, so it
+// outlives it.
+void keepcarry() {
+  m->PS = (m->PS & ~FLAGC) | carry(m->cc.op);
+}
+
+template <uint8_t OP, uint8_t L>
+static inline void setcc(const uint16_t src, const uint16_t dst, const uint16_t res) {
+  if (!(OP & CCTST) && (m->cc.op & CCTST)) {
+    keepcarry();
   }
-  setZ(uval == 0);
-  if ((isReg(da)) && (l == 1)) {
-    l = 2;
+  m->cc.op = OP;
+  m->cc.l = L;
+  m->cc.src = src;
+  m->cc.dst = dst;
+  m->cc.res = res;
+}
+
+// ccflags works out N, Z, V and C of the pending operation, which is
+// op, without touching PS. Called with a constant op it folds down to
+// the tests that kind of operation needs.
+static inline uint8_t ccflags(const uint8_t op) {
+  const uint16_t msb = m->cc.l == 2 ? 0x8000 : 0x80;
+  uint8_t f = 0;
+  if (m->cc.res & msb) {
+    f |= FLAGN;
+  }
+  if (m->cc.res == 0) {
+    f |= FLAGZ;
+  }
+  switch (op) {
+    case CCINC:
+      if (m->cc.res & msb) {
+        f |= FLAGV;
+      }
+      break;
+    case CCDEC:
+      if (m->cc.res == msb - 1) {
+        f |= FLAGV;
+      }
+      break;
+    case CCNEG:
+      if (m->cc.res == 0x8000) {
+        f |= FLAGV;
+      }
+      break;
+    case CCCMP:
+      if (((m->cc.src ^ m->cc.dst) & msb) && (!((m->cc.dst ^ m->cc.res) & msb))) {
+        f |= FLAGV;
+      }
+      break;
+    case CCADD:
+      if (!((m->cc.src ^ m->cc.dst) & 0x8000) && ((m->cc.dst ^ m->cc.res) & 0x8000)) {
+        f |= FLAGV;
+      }
+      break;
+    case CCSUB:
+      if (((m->cc.src ^ m->cc.dst) & 0x8000) && (!((m->cc.dst ^ m->cc.res) & 0x8000))) {
+        f |= FLAGV;
+      }
+      break;
+  }
+  return f | ((op & CCTST) ? carry(op) : m->PS & FLAGC);
+}
+
+uint16_t psw() {
+  if (m->cc.op == CCPS) {
+    return m->PS;
+  }
+  m->PS = (m->PS & 0xFFF0) | ccflags(m->cc.op);
+  m->cc.op = CCPS;
+  return m->PS;
+}
+
+void setpsw(const uint16_t v) {
+  m->cc.op = CCPS;
+  m->PS = v;
+}
+
+// clearcc starts an eagerly computed set of condition codes.
+static void clearcc() {
+  m->cc.op = CCPS;
+  m->PS &= 0xFFF0;
+}
+
+// Handlers of instructions with a destination operand are templates on
+// the operand width L and the source and destination modes SM and DM,
+// see the T entries in opcodes.h. Word only instructions ignore L,
+// instructions without a source operand ignore SM.
+
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void MOV(const decoded &in) {
+  const uint16_t msb = L == 2 ? 0x8000 : 0x80;
+  uint16_t uval = memread<L, SM>(aget<L, SM>(in.s));
+  if (faulted<SM>()) {
+    return;
+  }
+  const uint16_t da = aget<L, DM>(in.d);
+  if (faulted<DM>()) {
+    return;
+  }
+  setcc<CCNZ, L>(0, 0, uval);
+  if ((DM == 0) && (L == 1)) {
+    // MOVB to a register sign extends.
     if (uval & msb) {
       uval |= 0xFF00;
     }
+    memwrite<2, DM>(da, uval);
+    return;
   }
-  memwrite(da, l, uval);
+  memwrite<L, DM>(da, uval);
 }
 
-static void CMP(uint16_t instr) {
-  const uint8_t d = instr & 077;
-  const uint8_t s = (instr & 07700) >> 6;
-  const uint8_t l = 2 - (instr >> 15);
-  const uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  const uint16_t max = l == 2 ? 0xFFFF : 0xff;
-  uint16_t val1 = memread(aget(s, l), l);
-  const uint16_t da = aget(d, l);
-  uint16_t val2 = memread(da, l);
-  const int32_t sval = (val1 - val2) & max;
-  PS &= 0xFFF0;
-  setZ(sval == 0);
-  if (sval & msb) {
-    PS |= FLAGN;
-  }
-  if (((val1 ^ val2)&msb) && (!((val2 ^ sval)&msb))) {
-    PS |= FLAGV;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void CMP(const decoded &in) {
+  const uint16_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t val1 = memread<L, SM>(aget<L, SM>(in.s));
+  if (faulted<SM>()) {
+    return;
   }
-  if (val1 < val2) {
-    PS |= FLAGC;
+  const uint16_t da = aget<L, DM>(in.d);
+  const uint16_t val2 = memread<L, DM>(da);
+  if (faulted<DM>()) {
+    return;
   }
+  setcc<CCCMP, L>(val1, val2, (val1 - val2) & max);
 }
 
-static void BIT(uint16_t instr) {
-  const uint8_t d = instr & 077;
-  const uint8_t s = (instr & 07700) >> 6;
-  const uint8_t l = 2 - (instr >> 15);
-  const uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  const uint16_t val1 = memread(aget(s, l), l);
-  const uint16_t da = aget(d, l);
-  const uint16_t val2 = memread(da, l);
-  const uint16_t uval = val1 & val2;
-  PS &= 0xFFF1;
-  setZ(uval == 0);
-  if (uval & msb) {
-    PS |= FLAGN;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void BIT(const decoded &in) {
+  const uint16_t val1 = memread<L, SM>(aget<L, SM>(in.s));
+  if (faulted<SM>()) {
+    return;
+  }
+  const uint16_t da = aget<L, DM>(in.d);
+  const uint16_t val2 = memread<L, DM>(da);
+  if (faulted<DM>()) {
+    return;
   }
+  setcc<CCNZ, L>(0, 0, val1 & val2);
 }
 
-static void BIC(uint16_t instr) {
-  const uint8_t d = instr & 077;
-  const uint8_t s = (instr & 07700) >> 6;
-  const uint8_t l = 2 - (instr >> 15);
-  const uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  const uint16_t max = l == 2 ? 0xFFFF : 0xff;
-  const uint16_t val1 = memread(aget(s, l), l);
-  const uint16_t da = aget(d, l);
-  const uint16_t val2 = memread(da, l);
-  const uint16_t uval = (max ^ val1) & val2;
-  PS &= 0xFFF1;
-  setZ(uval == 0);
-  if (uval & msb) {
-    PS |= FLAGN;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void BIC(const decoded &in) {
+  const uint16_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t val1 = memread<L, SM>(aget<L, SM>(in.s));
+  if (faulted<SM>()) {
+    return;
+  }
+  const uint16_t da = aget<L, DM>(in.d);
+  const uint16_t val2 = memread<L, DM>(da);
+  if (faulted<DM>()) {
+    return;
   }
-  memwrite(da, l, uval);
+  const uint16_t uval = (max ^ val1) & val2;
+  setcc<CCNZ, L>(0, 0, uval);
+  memwrite<L, DM>(da, uval);
 }
 
-static void BIS(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t s = (instr & 07700) >> 6;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  uint16_t val1 = memread(aget(s, l), l);
-  uint16_t da = aget(d, l);
-  uint16_t val2 = memread(da, l);
-  uint16_t uval = val1 | val2;
-  PS &= 0xFFF1;
-  setZ(uval == 0);
-  if (uval & msb) {
-    PS |= FLAGN;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void BIS(const decoded &in) {
+  const uint16_t val1 = memread<L, SM>(aget<L, SM>(in.s));
+  if (faulted<SM>()) {
+    return;
   }
-  memwrite(da, l, uval);
+  const uint16_t da = aget<L, DM>(in.d);
+  const uint16_t val2 = memread<L, DM>(da);
+  if (faulted<DM>()) {
+    return;
+  }
+  const uint16_t uval = val1 | val2;
+  setcc<CCNZ, L>(0, 0, uval);
+  memwrite<L, DM>(da, uval);
 }
 
-static void ADD(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t s = (instr & 07700) >> 6;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t val1 = memread16(aget(s, 2));
-  uint16_t da = aget(d, 2);
-  uint16_t val2 = memread16(da);
-  uint16_t uval = (val1 + val2) & 0xFFFF;
-  PS &= 0xFFF0;
-  setZ(uval == 0);
-  if (uval & 0x8000) {
-    PS |= FLAGN;
-  }
-  if (!((val1 ^ val2) & 0x8000) && ((val2 ^ uval) & 0x8000)) {
-    PS |= FLAGV;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void ADD(const decoded &in) {
+  const uint16_t val1 = memread<2, SM>(aget<2, SM>(in.s));
+  if (faulted<SM>()) {
+    return;
   }
-  if ((val1 + val2) >= 0xFFFF) {
-    PS |= FLAGC;
+  const uint16_t da = aget<2, DM>(in.d);
+  const uint16_t val2 = memread<2, DM>(da);
+  if (faulted<DM>()) {
+    return;
   }
-  memwrite16(da, uval);
+  const uint16_t uval = (val1 + val2) & 0xFFFF;
+  setcc<CCADD, 2>(val1, val2, uval);
+  memwrite<2, DM>(da, uval);
 }
 
-static void SUB(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t s = (instr & 07700) >> 6;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t val1 = memread16(aget(s, 2));
-  uint16_t da = aget(d, 2);
-  uint16_t val2 = memread16(da);
-  uint16_t uval = (val2 - val1) & 0xFFFF;
-  PS &= 0xFFF0;
-  setZ(uval == 0);
-  if (uval & 0x8000) {
-    PS |= FLAGN;
-  }
-  if (((val1 ^ val2) & 0x8000) && (!((val2 ^ uval) & 0x8000))) {
-    PS |= FLAGV;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void SUB(const decoded &in) {
+  const uint16_t val1 = memread<2, SM>(aget<2, SM>(in.s));
+  if (faulted<SM>()) {
+    return;
   }
-  if (val1 > val2) {
-    PS |= FLAGC;
+  const uint16_t da = aget<2, DM>(in.d);
+  const uint16_t val2 = memread<2, DM>(da);
+  if (faulted<DM>()) {
+    return;
   }
-  memwrite16(da, uval);
+  const uint16_t uval = (val2 - val1) & 0xFFFF;
+  setcc<CCSUB, 2>(val1, val2, uval);
+  memwrite<2, DM>(da, uval);
 }
 
-static void JSR(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t s = (instr & 07700) >> 6;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t uval = aget(d, l);
-  if (isReg(uval)) {
-    Serial.println(F("JSR called on register"));
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void JSR(const decoded &in) {
+  const uint8_t s = in.s;
+  const uint16_t uval = aget<2, DM>(in.d);
+  if (faulted<DM>()) {
+    return;
+  }
+  if (DM == 0) {
+    xprintf("JSR called on register\r\n");
     panic();
   }
-  push(R[s & 7]);
-  R[s & 7] = R[7];
-  R[7] = uval;
+  push(m->R[s & 7]);
+  if (m->trapped) {
+    return;
+  }
+  m->R[s & 7] = m->R[7];
+  m->R[7] = uval;
 }
 
-static void MUL(const uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t s = (instr & 07700) >> 6;
-  int32_t val1 = R[s & 7];
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void MUL(const decoded &in) {
+  const uint8_t s = in.s;
+  int32_t val1 = m->R[s & 7];
   if (val1 & 0x8000) {
     val1 = -((0xFFFF ^ val1) + 1);
   }
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t da = aget(d, l);
-  int32_t val2 = memread16(da);
+  const uint16_t da = aget<2, DM>(in.d);
+  int32_t val2 = memread<2, DM>(da);
+  if (faulted<DM>()) {
+    return;
+  }
   if (val2 & 0x8000) {
     val2 = -((0xFFFF ^ val2) + 1);
   }
   int32_t sval = val1 * val2;
-  R[s & 7] = sval >> 16;
-  R[(s & 7) | 1] = sval & 0xFFFF;
-  PS &= 0xFFF0;
+  m->R[s & 7] = sval >> 16;
+  m->R[(s & 7) | 1] = sval & 0xFFFF;
+  clearcc();
   if (sval & 0x80000000) {
-    PS |= FLAGN;
+    m->PS |= FLAGN;
   }
   setZ((sval & 0xFFFFFFFF) == 0);
   if ((sval < (1 << 15)) || (sval >= ((1 << 15) - 1))) {
-    PS |= FLAGC;
+    m->PS |= FLAGC;
   }
 }
 
-static void DIV(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t s = (instr & 07700) >> 6;
-  int32_t val1 = (R[s & 7] << 16) | (R[(s & 7) | 1]);
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t da = aget(d, l);
-  int32_t val2 = memread16(da);
-  PS &= 0xFFF0;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void DIV(const decoded &in) {
+  const uint8_t s = in.s;
+  int32_t val1 = (m->R[s & 7] << 16) | (m->R[(s & 7) | 1]);
+  const uint16_t da = aget<2, DM>(in.d);
+  int32_t val2 = memread<2, DM>(da);
+  if (faulted<DM>()) {
+    return;
+  }
+  clearcc();
   if (val2 == 0) {
-    PS |= FLAGC;
+    m->PS |= FLAGC;
     return;
   }
   if ((val1 / val2) >= 0x10000) {
-    PS |= FLAGV;
+    m->PS |= FLAGV;
     return;
   }
-  R[s & 7] = (val1 / val2) & 0xFFFF;
-  R[(s & 7) | 1] = (val1 % val2) & 0xFFFF;
-  setZ(R[s & 7] == 0);
-  if (R[s & 7] & 0100000) {
-    PS |= FLAGN;
+  m->R[s & 7] = (val1 / val2) & 0xFFFF;
+  m->R[(s & 7) | 1] = (val1 % val2) & 0xFFFF;
+  setZ(m->R[s & 7] == 0);
+  if (m->R[s & 7] & 0100000) {
+    m->PS |= FLAGN;
   }
   if (val1 == 0) {
-    PS |= FLAGV;
+    m->PS |= FLAGV;
   }
 }
 
-static void ASH(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t s = (instr & 07700) >> 6;
-  uint16_t val1 = R[s & 7];
-  uint16_t da = aget(d, 2);
-  uint16_t val2 = memread16(da) & 077;
-  PS &= 0xFFF0;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void ASH(const decoded &in) {
+  const uint8_t s = in.s;
+  uint16_t val1 = m->R[s & 7];
+  const uint16_t da = aget<2, DM>(in.d);
+  uint16_t val2 = memread<2, DM>(da) & 077;
+  if (faulted<DM>()) {
+    return;
+  }
+  clearcc();
   int32_t sval;
   if (val2 & 040) {
     val2 = (077 ^ val2) + 1;
@@ -418,32 +665,35 @@ static void ASH(uint16_t instr) {
       sval = val1 >> val2;
     }
     if (val1 & (1 << (val2 - 1))) {
-      PS |= FLAGC;
+      m->PS |= FLAGC;
     }
   }
   else {
     sval = (val1 << val2) & 0xFFFF;
     if (val1 & (1 << (16 - val2))) {
-      PS |= FLAGC;
+      m->PS |= FLAGC;
     }
   }
-  R[s & 7] = sval;
+  m->R[s & 7] = sval;
   setZ(sval == 0);
   if (sval & 0100000) {
-    PS |= FLAGN;
+    m->PS |= FLAGN;
   }
   if ((sval & 0100000) xor (val1 & 0100000)) {
-    PS |= FLAGV;
+    m->PS |= FLAGV;
   }
 }
 
-static void ASHC(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t s = (instr & 07700) >> 6;
-  uint16_t val1 = R[s & 7] << 16 | R[(s & 7) | 1];
-  uint16_t da = aget(d, 2);
-  uint16_t val2 = memread16(da) & 077;
-  PS &= 0xFFF0;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void ASHC(const decoded &in) {
+  const uint8_t s = in.s;
+  uint16_t val1 = m->R[s & 7] << 16 | m->R[(s & 7) | 1];
+  const uint16_t da = aget<2, DM>(in.d);
+  uint16_t val2 = memread<2, DM>(da) & 077;
+  if (faulted<DM>()) {
+    return;
+  }
+  clearcc();
   int32_t sval;
   if (val2 & 040) {
     val2 = (077 ^ val2) + 1;
@@ -455,703 +705,1167 @@ static void ASHC(uint16_t instr) {
       sval = val1 >> val2;
     }
     if (val1 & (1 << (val2 - 1))) {
-      PS |= FLAGC;
+      m->PS |= FLAGC;
     }
   }
   else {
     sval = (val1 << val2) & 0xFFFFFFFF;
     if (val1 & (1 << (32 - val2))) {
-      PS |= FLAGC;
+      m->PS |= FLAGC;
     }
   }
-  R[s & 7] = (sval >> 16) & 0xFFFF;
-  R[(s & 7) | 1] = sval & 0xFFFF;
+  m->R[s & 7] = (sval >> 16) & 0xFFFF;
+  m->R[(s & 7) | 1] = sval & 0xFFFF;
   setZ(sval == 0);
   if (sval & 0x80000000) {
-    PS |= FLAGN;
+    m->PS |= FLAGN;
   }
   if ((sval & 0x80000000) xor (val1 & 0x80000000)) {
-    PS |= FLAGV;
+    m->PS |= FLAGV;
   }
 }
 
-static void XOR(uint16_t instr) {
-  const uint8_t d = instr & 077;
-  const uint8_t s = (instr & 07700) >> 6;
-  const uint16_t val1 = R[s & 7];
-  const uint16_t da = aget(d, 2);
-  const uint16_t val2 = memread16(da);
-  const uint16_t uval = val1 ^ val2;
-  PS &= 0xFFF1;
-  setZ(uval == 0);
-  if (uval & 0x8000) {
-    PS |= FLAGN;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void XOR(const decoded &in) {
+  const uint8_t s = in.s;
+  const uint16_t val1 = m->R[s & 7];
+  const uint16_t da = aget<2, DM>(in.d);
+  const uint16_t val2 = memread<2, DM>(da);
+  if (faulted<DM>()) {
+    return;
   }
-  memwrite16(da, uval);
+  const uint16_t uval = val1 ^ val2;
+  setcc<CCNZ, 2>(0, 0, uval);
+  memwrite<2, DM>(da, uval);
 }
 
-static void SOB(const uint16_t instr) {
-  const uint8_t s = (instr & 07700) >> 6;
-  uint8_t o = instr & 0xFF;
-  R[s & 7]--;
-  if (R[s & 7]) {
+static void SOB(const decoded &in) {
+  const uint8_t s = in.s;
+  uint8_t o = in.instr & 0xFF;
+  m->R[s & 7]--;
+  if (m->R[s & 7]) {
     o &= 077;
     o <<= 1;
-    R[7] -= o;
+    m->R[7] -= o;
   }
 }
 
-static void CLR(uint16_t instr) {
-  const uint8_t d = instr & 077;
-  const uint8_t l = 2 - (instr >> 15);
-  PS &= 0xFFF0;
-  PS |= FLAGZ;
-  memwrite(aget(d, l), l, 0);
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void CLR(const decoded &in) {
+  setcc<CCTST, L>(0, 0, 0);
+  memwrite<L, DM>(aget<L, DM>(in.d), 0);
 }
 
-static void COM(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t s = (instr & 07700) >> 6;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  uint16_t max = l == 2 ? 0xFFFF : 0xff;
-  uint16_t da = aget(d, l);
-  uint16_t uval = memread(da, l) ^ max;
-  PS &= 0xFFF0;
-  PS |= FLAGC;
-  if (uval & msb) {
-    PS |= FLAGN;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void COM(const decoded &in) {
+  const uint16_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t da = aget<L, DM>(in.d);
+  const uint16_t uval = memread<L, DM>(da) ^ max;
+  if (faulted<DM>()) {
+    return;
   }
-  setZ(uval == 0);
-  memwrite(da, l, uval);
+  setcc<CCCOM, L>(0, 0, uval);
+  memwrite<L, DM>(da, uval);
 }
 
-static void INC(const uint16_t instr) {
-  const uint8_t d = instr & 077;
-  const uint8_t l = 2 - (instr >> 15);
-  const uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  const uint16_t max = l == 2 ? 0xFFFF : 0xff;
-  const uint16_t da = aget(d, l);
-  const uint16_t uval = (memread(da, l) + 1) & max;
-  PS &= 0xFFF1;
-  if (uval & msb) {
-    PS |= FLAGN | FLAGV;
-  }
-  setZ(uval == 0);
-  memwrite(da, l, uval);
-}
-
-static void _DEC(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  uint16_t max = l == 2 ? 0xFFFF : 0xff;
-  uint16_t maxp = l == 2 ? 0x7FFF : 0x7f;
-  uint16_t da = aget(d, l);
-  uint16_t uval = (memread(da, l) - 1) & max;
-  PS &= 0xFFF1;
-  if (uval & msb) {
-    PS |= FLAGN;
-  }
-  if (uval == maxp) {
-    PS |= FLAGV;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void INC(const decoded &in) {
+  const uint16_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t da = aget<L, DM>(in.d);
+  const uint16_t uval = (memread<L, DM>(da) + 1) & max;
+  if (faulted<DM>()) {
+    return;
   }
-  setZ(uval == 0);
-  memwrite(da, l, uval);
+  setcc<CCINC, L>(0, 0, uval);
+  memwrite<L, DM>(da, uval);
 }
 
-static void NEG(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  uint16_t max = l == 2 ? 0xFFFF : 0xff;
-  uint16_t da = aget(d, l);
-  int32_t sval = (-memread(da, l)) & max;
-  PS &= 0xFFF0;
-  if (sval & msb) {
-    PS |= FLAGN;
-  }
-  if (sval == 0) {
-    PS |= FLAGZ;
-  }
-  else {
-    PS |= FLAGC;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void _DEC(const decoded &in) {
+  const uint16_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t da = aget<L, DM>(in.d);
+  const uint16_t uval = (memread<L, DM>(da) - 1) & max;
+  if (faulted<DM>()) {
+    return;
   }
-  if (sval == 0x8000) {
-    PS |= FLAGV;
+  setcc<CCDEC, L>(0, 0, uval);
+  memwrite<L, DM>(da, uval);
+}
+
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void NEG(const decoded &in) {
+  const uint16_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t da = aget<L, DM>(in.d);
+  const int32_t sval = (-memread<L, DM>(da)) & max;
+  if (faulted<DM>()) {
+    return;
   }
-  memwrite(da, l, sval);
+  setcc<CCNEG, L>(0, 0, sval);
+  memwrite<L, DM>(da, sval);
 }
 
-static void _ADC(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  uint16_t max = l == 2 ? 0xFFFF : 0xff;
-  uint16_t da = aget(d, l);
-  uint16_t uval = memread(da, l);
-  if (PS & FLAGC) {
-    PS &= 0xFFF0;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void _ADC(const decoded &in) {
+  const uint16_t msb = L == 2 ? 0x8000 : 0x80;
+  const uint16_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t da = aget<L, DM>(in.d);
+  const uint16_t uval = memread<L, DM>(da);
+  if (faulted<DM>()) {
+    return;
+  }
+  if (psw() & FLAGC) {
+    clearcc();
     if ((uval + 1)&msb) {
-      PS |= FLAGN;
+      m->PS |= FLAGN;
     }
     setZ(uval == max);
     if (uval == 0077777) {
-      PS |= FLAGV;
+      m->PS |= FLAGV;
     }
     if (uval == 0177777) {
-      PS |= FLAGC;
+      m->PS |= FLAGC;
     }
-    memwrite(da, l, (uval + 1)&max);
+    memwrite<L, DM>(da, (uval + 1)&max);
   }
   else {
-    PS &= 0xFFF0;
+    clearcc();
     if (uval & msb) {
-      PS |= FLAGN;
+      m->PS |= FLAGN;
     }
     setZ(uval == 0);
   }
 }
 
-static void SBC(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  uint16_t max = l == 2 ? 0xFFFF : 0xff;
-  uint16_t da = aget(d, l);
-  int32_t sval = memread(da, l);
-  if (PS & FLAGC) {
-    PS &= 0xFFF0;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void SBC(const decoded &in) {
+  const uint16_t msb = L == 2 ? 0x8000 : 0x80;
+  const uint16_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t da = aget<L, DM>(in.d);
+  const int32_t sval = memread<L, DM>(da);
+  if (faulted<DM>()) {
+    return;
+  }
+  if (psw() & FLAGC) {
+    clearcc();
     if ((sval - 1)&msb) {
-      PS |= FLAGN;
+      m->PS |= FLAGN;
     }
     setZ(sval == 1);
     if (sval) {
-      PS |= FLAGC;
+      m->PS |= FLAGC;
     }
     if (sval == 0100000) {
-      PS |= FLAGV;
+      m->PS |= FLAGV;
     }
-    memwrite(da, l, (sval - 1)&max);
+    memwrite<L, DM>(da, (sval - 1)&max);
   }
   else {
-    PS &= 0xFFF0;
+    clearcc();
     if (sval & msb) {
-      PS |= FLAGN;
+      m->PS |= FLAGN;
     }
     setZ(sval == 0);
     if (sval == 0100000) {
-      PS |= FLAGV;
+      m->PS |= FLAGV;
     }
-    PS |= FLAGC;
+    m->PS |= FLAGC;
   }
 }
 
-static void TST(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  uint16_t uval = memread(aget(d, l), l);
-  PS &= 0xFFF0;
-  if (uval & msb) {
-    PS |= FLAGN;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void TST(const decoded &in) {
+  const uint16_t uval = memread<L, DM>(aget<L, DM>(in.d));
+  if (faulted<DM>()) {
+    return;
   }
-  setZ(uval == 0);
+  setcc<CCTST, L>(0, 0, uval);
 }
 
-static void ROR(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  int32_t max = l == 2 ? 0xFFFF : 0xff;
-  uint16_t da = aget(d, l);
-  int32_t sval = memread(da, l);
-  if (PS & FLAGC) {
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void ROR(const decoded &in) {
+  const int32_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t da = aget<L, DM>(in.d);
+  int32_t sval = memread<L, DM>(da);
+  if (faulted<DM>()) {
+    return;
+  }
+  if (psw() & FLAGC) {
     sval |= max + 1;
   }
-  PS &= 0xFFF0;
+  clearcc();
   if (sval & 1) {
-    PS |= FLAGC;
+    m->PS |= FLAGC;
   }
   // watch out for integer wrap around
   if (sval & (max + 1)) {
-    PS |= FLAGN;
+    m->PS |= FLAGN;
   }
   setZ(!(sval & max));
   if ((sval & 1) xor (sval & (max + 1))) {
-    PS |= FLAGV;
+    m->PS |= FLAGV;
   }
   sval >>= 1;
-  memwrite(da, l, sval);
+  memwrite<L, DM>(da, sval);
 }
 
-static void ROL(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  int32_t max = l == 2 ? 0xFFFF : 0xff;
-  uint16_t da = aget(d, l);
-  int32_t sval = memread(da, l) << 1;
-  if (PS & FLAGC) {
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void ROL(const decoded &in) {
+  const uint16_t msb = L == 2 ? 0x8000 : 0x80;
+  const int32_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t da = aget<L, DM>(in.d);
+  int32_t sval = memread<L, DM>(da) << 1;
+  if (faulted<DM>()) {
+    return;
+  }
+  if (psw() & FLAGC) {
     sval |= 1;
   }
-  PS &= 0xFFF0;
+  clearcc();
   if (sval & (max + 1)) {
-    PS |= FLAGC;
+    m->PS |= FLAGC;
   }
   if (sval & msb) {
-    PS |= FLAGN;
+    m->PS |= FLAGN;
   }
   setZ(!(sval & max));
   if ((sval ^ (sval >> 1))&msb) {
-    PS |= FLAGV;
+    m->PS |= FLAGV;
   }
   sval &= max;
-  memwrite(da, l, sval);
+  memwrite<L, DM>(da, sval);
 }
 
-static void ASR(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  uint16_t da = aget(d, l);
-  uint16_t uval = memread(da, l);
-  PS &= 0xFFF0;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void ASR(const decoded &in) {
+  const uint16_t msb = L == 2 ? 0x8000 : 0x80;
+  const uint16_t da = aget<L, DM>(in.d);
+  uint16_t uval = memread<L, DM>(da);
+  if (faulted<DM>()) {
+    return;
+  }
+  clearcc();
   if (uval & 1) {
-    PS |= FLAGC;
+    m->PS |= FLAGC;
   }
   if (uval & msb) {
-    PS |= FLAGN;
+    m->PS |= FLAGN;
   }
   if ((uval & msb) xor (uval & 1)) {
-    PS |= FLAGV;
+    m->PS |= FLAGV;
   }
   uval = (uval & msb) | (uval >> 1);
   setZ(uval == 0);
-  memwrite(da, l, uval);
+  memwrite<L, DM>(da, uval);
 }
 
-static void ASL(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t msb = l == 2 ? 0x8000 : 0x80;
-  uint16_t max = l == 2 ? 0xFFFF : 0xff;
-  uint16_t da = aget(d, l);
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void ASL(const decoded &in) {
+  const uint16_t msb = L == 2 ? 0x8000 : 0x80;
+  const uint16_t max = L == 2 ? 0xFFFF : 0xff;
+  const uint16_t da = aget<L, DM>(in.d);
   // TODO(dfc) doesn't need to be an sval
-  int32_t sval = memread(da, l);
-  PS &= 0xFFF0;
+  int32_t sval = memread<L, DM>(da);
+  if (faulted<DM>()) {
+    return;
+  }
+  clearcc();
   if (sval & msb) {
-    PS |= FLAGC;
+    m->PS |= FLAGC;
   }
   if (sval & (msb >> 1)) {
-    PS |= FLAGN;
+    m->PS |= FLAGN;
   }
   if ((sval ^ (sval << 1))&msb) {
-    PS |= FLAGV;
+    m->PS |= FLAGV;
   }
   sval = (sval << 1) & max;
   setZ(sval == 0);
-  memwrite(da, l, sval);
+  memwrite<L, DM>(da, sval);
 }
 
-static void SXT(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t max = l == 2 ? 0xFFFF : 0xff;
-  uint16_t da = aget(d, l);
-  if (PS & FLAGN) {
-    memwrite(da, l, max);
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void SXT(const decoded &in) {
+  const uint16_t da = aget<2, DM>(in.d);
+  if (faulted<DM>()) {
+    return;
+  }
+  if (psw() & FLAGN) {
+    memwrite<2, DM>(da, 0xFFFF);
   }
   else {
-    PS |= FLAGZ;
-    memwrite(da, l, 0);
+    m->PS |= FLAGZ;
+    memwrite<2, DM>(da, 0);
   }
 }
 
-static void JMP(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint16_t uval = aget(d, 2);
-  if (isReg(uval)) {
-    Serial.println(F("JMP called with register dest"));
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void JMP(const decoded &in) {
+  const uint16_t uval = aget<2, DM>(in.d);
+  if (faulted<DM>()) {
+    return;
+  }
+  if (DM == 0) {
+    xprintf("JMP called with register dest\r\n");
     panic();
   }
-  R[7] = uval;
+  m->R[7] = uval;
 }
 
-static void SWAB(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint8_t l = 2 - (instr >> 15);
-  uint16_t da = aget(d, l);
-  uint16_t uval = memread(da, l);
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void SWAB(const decoded &in) {
+  const uint16_t da = aget<2, DM>(in.d);
+  uint16_t uval = memread<2, DM>(da);
+  if (faulted<DM>()) {
+    return;
+  }
   uval = ((uval >> 8) | (uval << 8)) & 0xFFFF;
-  PS &= 0xFFF0;
+  clearcc();
   setZ(uval & 0xFF);
   if (uval & 0x80) {
-    PS |= FLAGN;
+    m->PS |= FLAGN;
   }
-  memwrite(da, l, uval);
+  memwrite<2, DM>(da, uval);
 }
 
-static void MARK(uint16_t instr) {
-  R[6] = R[7] + ((instr & 077) << 1);
-  R[7] = R[5];
-  R[5] = pop();
+static void MARK(const decoded &in) {
+  m->R[6] = m->R[7] + ((in.d) << 1);
+  m->R[7] = m->R[5];
+  const uint16_t uval = pop();
+  if (m->trapped) {
+    return;
+  }
+  m->R[5] = uval;
 }
 
-static void MFPI(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint16_t da = aget(d, 2);
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void MFPI(const decoded &in) {
+  const uint16_t da = aget<2, DM>(in.d);
+  if (faulted<DM>()) {
+    return;
+  }
   uint16_t uval;
-  if (da == 0170006) {
+  if ((DM == 0) && (da == 6)) {
     // val = (curuser == prevuser) ? R[6] : (prevuser ? k.USP : KSP);
-    if (curuser == prevuser) {
-      uval = R[6];
+    if (m->curuser == m->prevuser) {
+      uval = m->R[6];
     }
     else {
-      if (prevuser) {
-        uval = USP;
+      if (m->prevuser) {
+        uval = m->USP;
       }
       else {
-        uval = KSP;
+        uval = m->KSP;
       }
     }
   }
-  else if (isReg(da)) {
-    Serial.println(F("invalid MFPI instruction"));
+  else if (DM == 0) {
+    xprintf("invalid MFPI instruction\r\n");
     panic();
   }
   else {
-    uval = unibus::read16(mmu::decode((uint16_t)da, false, prevuser));
+    const uint32_t pa = mmu::decode(da, false, m->prevuser, in.instr & 0100000);
+    if (m->trapped) {
+      return;
+    }
+    uval = unibus::read16(pa);
+    if (m->trapped) {
+      return;
+    }
   }
   push(uval);
-  PS &= 0xFFF0;
-  PS |= FLAGC;
+  if (m->trapped) {
+    return;
+  }
+  clearcc();
+  m->PS |= FLAGC;
   setZ(uval == 0);
   if (uval & 0x8000) {
-    PS |= FLAGN;
+    m->PS |= FLAGN;
   }
 }
 
-static void MTPI(uint16_t instr) {
-  uint8_t d = instr & 077;
-  uint16_t da = aget(d, 2);
-  uint16_t uval = pop();
-  if (da == 0170006) {
-    if (curuser == prevuser) {
-      R[6] = uval;
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void MTPI(const decoded &in) {
+  const uint16_t da = aget<2, DM>(in.d);
+  if (faulted<DM>()) {
+    return;
+  }
+  const uint16_t uval = pop();
+  if (m->trapped) {
+    return;
+  }
+  if ((DM == 0) && (da == 6)) {
+    if (m->curuser == m->prevuser) {
+      m->R[6] = uval;
     }
     else {
-      if (prevuser) {
-        USP = uval;
+      if (m->prevuser) {
+        m->USP = uval;
       }
       else {
-        KSP = uval;
+        m->KSP = uval;
       }
     }
   }
-  else if (isReg(da)) {
-    Serial.println(F("invalid MTPI instrution")); panic();
+  else if (DM == 0) {
+    xprintf("invalid MTPI instrution\r\n"); panic();
   }
   else {
-    unibus::write16(mmu::decode((uint16_t)da, true, prevuser), uval);
+    const uint32_t pa = mmu::decode(da, true, m->prevuser, in.instr & 0100000);
+    if (m->trapped) {
+      return;
+    }
+    unibus::write16(pa, uval);
+    if (m->trapped) {
+      return;
+    }
   }
-  PS &= 0xFFF0;
-  PS |= FLAGC;
+  clearcc();
+  m->PS |= FLAGC;
   setZ(uval == 0);
   if (uval & 0x8000) {
-    PS |= FLAGN;
+    m->PS |= FLAGN;
   }
 }
 
-static void RTS(uint16_t instr) {
-  uint8_t d = instr & 077;
-  R[7] = R[d & 7];
-  R[d & 7] = pop();
+// MFPD and MTPD move from and to the previous mode's D space, which is
+// its I space unless the 11/70's SR3 enables it.
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void MFPD(const decoded &in) {
+  MFPI<L, SM, DM>(in);
 }
 
-static void EMTX(uint16_t instr) {
+template <uint8_t L, uint8_t SM, uint8_t DM>
+static void MTPD(const decoded &in) {
+  MTPI<L, SM, DM>(in);
+}
+
+static void RTS(const decoded &in) {
+  uint8_t d = in.d;
+  m->R[7] = m->R[d & 7];
+  const uint16_t uval = pop();
+  if (m->trapped) {
+    return;
+  }
+  m->R[d & 7] = uval;
+}
+
+static void EMTX(const decoded &in) {
   uint16_t uval;
-  if ((instr & 0177400) == 0104000) {
+  if ((in.instr & 0177400) == 0104000) {
     uval = 030;
   }
-  else if ((instr & 0177400) == 0104400) {
+  else if ((in.instr & 0177400) == 0104400) {
     uval = 034;
   }
-  else if (instr == 3) {
+  else if (in.instr == 3) {
     uval = 014;
   }
   else {
     uval = 020;
   }
-  uint16_t prev = PS;
+  const uint16_t prev = psw();
   switchmode(false);
   push(prev);
-  push(R[7]);
-  R[7] = unibus::read16(uval);
-  PS = unibus::read16(uval + 2);
-  if (prevuser) {
-    PS |= (1 << 13) | (1 << 12);
+  if (m->trapped) {
+    return;
+  }
+  push(m->R[7]);
+  if (m->trapped) {
+    return;
+  }
+  m->R[7] = unibus::read16(uval);
+  m->PS = unibus::read16(uval + 2);
+  if (m->prevuser) {
+    m->PS |= (1 << 13) | (1 << 12);
   }
 }
 
-static void RTT(uint16_t instr) {
-  R[7] = pop();
+static void RTT(const decoded &in) {
+  const uint16_t pc = pop();
+  if (m->trapped) {
+    return;
+  }
+  m->R[7] = pc;
   uint16_t uval = pop();
-  if (curuser) {
+  if (m->trapped) {
+    return;
+  }
+  if (m->curuser) {
     uval &= 047;
-    uval |= PS & 0177730;
+    uval |= psw() & 0177730;
   }
-  unibus::write16(0777776, uval);
+  unibus::write16(unibus::io(0777776), uval);
 }
 
-static void RESET(uint16_t instr) {
-  if (curuser) {
+static void RESET(const decoded &in) {
+  if (m->curuser) {
     return;
   }
-  cons::clearterminal();
-  rk11::reset();
+  unibus::reset();
 }
 
-void step() {
-  PC = R[7];
-  uint16_t instr = unibus::read16(mmu::decode(PC, false, curuser));
- // return;
-  R[7] += 2;
+static void BR(const decoded &in) {
+  branch(in.instr & 0xFF);
+}
 
-  if (PRINTSTATE) printstate();
+// branches[c] has bit NZVC set when condition c holds for those
+// condition codes, c is bit 15 and bits 8-10 of the instruction.
+static constexpr bool taken(const uint8_t c, const uint8_t f) {
+  const bool n = f & FLAGN;
+  const bool z = f & FLAGZ;
+  const bool v = f & FLAGV;
+  const bool cc = f & FLAGC;
+  switch (c) {
+    case 001: return true;                // BR
+    case 002: return !z;                  // BNE
+    case 003: return z;                   // BEQ
+    case 004: return !(n xor v);          // BGE
+    case 005: return n xor v;             // BLT
+    case 006: return !(n xor v) && !z;    // BGT
+    case 007: return (n xor v) || z;      // BLE
+    case 010: return !n;                  // BPL
+    case 011: return n;                   // BMI
+    case 012: return !cc && !z;           // BHI
+    case 013: return cc || z;             // BLOS
+    case 014: return !v;                  // BVC
+    case 015: return v;                   // BVS
+    case 016: return !cc;                 // BCC
+    case 017: return cc;                  // BCS
+  }
+  return false;
+}
 
-  switch ((instr >> 12) & 007) {
-    case 001: // MOV
-      MOV(instr);
-      return;
-    case 002: // CMP
-      CMP(instr);
-      return;
-    case 003: // BIT
-      BIT(instr);
-      return;
-    case 004: // BIC
-      BIC(instr);
-      return;
-    case 005: // BIS
-      BIS(instr);
-      return;
+struct truthtable {
+  uint16_t t[16];
+};
+
+static constexpr truthtable maketruth() {
+  truthtable b = {};
+  for (uint8_t c = 0; c < 16; c++) {
+    for (uint8_t f = 0; f < 16; f++) {
+      if (taken(c, f)) {
+        b.t[c] |= 1 << f;
+      }
+    }
   }
-  switch ((instr >> 12) & 017) {
-    case 006: // ADD
-      ADD(instr);
-      return;
-    case 016: // SUB
-      SUB(instr);
-      return;
+  return b;
+}
+
+static constexpr truthtable branches = maketruth();
+
+static void BXX(const decoded &in) {
+  const uint8_t c = ((in.instr >> 12) & 010) | ((in.instr >> 8) & 7);
+  if ((branches.t[c] >> (psw() & 017)) & 1) {
+    branch(in.instr & 0xFF);
   }
-  switch ((instr >> 9) & 0177) {
-    case 0004: // JSR
-      JSR(instr);
-      return;
-    case 0070: // MUL
-      MUL(instr);
-      return;
-    case 0071: // DIV
-      DIV(instr);
-      return;
-    case 0072: // ASH
-      ASH(instr);
-      return;
-    case 0073: // ASHC
-      ASHC(instr);
-      return;
-    case 0074: // XOR
-      XOR(instr);
-      return;
-    case 0077: // SOB
-      SOB(instr);
-      return;
+}
+
+// CL?, SE?
+static void CCOP(const decoded &in) {
+  psw();
+  if (in.instr & 020) {
+    m->PS |= in.instr & 017;
   }
-  switch ((instr >> 6) & 00777) {
-    case 00050: // CLR
-      CLR(instr);
-      return;
-    case 00051: // COM
-      COM(instr);
-      return;
-    case 00052: // INC
-      INC(instr);
-      return;
-    case 00053: // DEC
-      _DEC(instr);
-      return;
-    case 00054: // NEG
-      NEG(instr);
-      return;
-    case 00055: // ADC
-      _ADC(instr);
-      return;
-    case 00056: // SBC
-      SBC(instr);
-      return;
-    case 00057: // TST
-      TST(instr);
-      return;
-    case 00060: // ROR
-      ROR(instr);
-      return;
-    case 00061: // ROL
-      ROL(instr);
-      return;
-    case 00062: // ASR
-      ASR(instr);
-      return;
-    case 00063: // ASL
-      ASL(instr);
-      return;
-    case 00067: // SXT
-      SXT(instr);
-      return;
+  else {
+    m->PS &= ~in.instr & 017;
   }
-  switch (instr & 0177700) {
-    case 0000100: // JMP
-      JMP(instr);
-      return;
-    case 0000300: // SWAB
-      SWAB(instr);
-      return;
-    case 0006400: // MARK
-      MARK(instr);
-      break;
-    case 0006500: // MFPI
-      MFPI(instr);
-      return;
-    case 0006600: // MTPI
-      MTPI(instr);
-      return;
+}
+
+static void INVAL(const decoded &in) {
+  xprintf("invalid instruction\r\n");
+  trap(INTINVAL);
+}
+
+static void HALT(const decoded &in) {
+  if (m->curuser) {
+    INVAL(in);
+    return;
   }
-  if ((instr & 0177770) == 0000200) { // RTS
-    RTS(instr);
+  xprintf("HALT\r\n");
+  panic();
+}
+
+// WAIT leaves loop0 to idle until an interrupt is due.
+static void WAIT(const decoded &in) {
+  if (m->curuser) {
+    INVAL(in);
     return;
   }
+  m->waiting = true;
+#if !defined(__AVR__)
+  m->exitblock = true;
+#endif
+}
 
-  switch (instr & 0177400) {
-    case 0000400:
-      branch(instr & 0xFF);
-      return;
-    case 0001000:
-      if (!Z()) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0001400:
-      if (Z()) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0002000:
-      if (!(N() xor V())) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0002400:
-      if (N() xor V()) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0003000:
-      if ((!(N() xor V())) && (!Z())) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0003400:
-      if ((N() xor V()) || Z()) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0100000:
-      if (!N()) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0100400:
-      if (N()) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0101000:
-      if ((!C()) && (!Z())) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0101400:
-      if (C() || Z()) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0102000:
-      if (!V()) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0102400:
-      if (V()) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0103000:
-      if (!C()) {
-        branch(instr & 0xFF);
-      }
-      return;
-    case 0103400:
-      if (C()) {
-        branch(instr & 0xFF);
-      }
-      return;
+// SETD ; not needed by UNIX, but used; therefore ignored
+static void SETD(const decoded &in) {
+}
+
+// A specialization of a T handler is selected by a 7 bit key: the byte
+// bit, the source mode and the destination mode. Parameters a handler
+// ignores are fixed, so it is only instantiated once for each set of
+// parameters it does use.
+enum { NKEYS = 0200 };
+
+static constexpr uint8_t width(const bool b, const uint8_t key) {
+  return (b && (key & 0100)) ? 1 : 2;
+}
+
+static constexpr uint8_t smode(const uint8_t flags, const uint8_t key) {
+  return (flags & S) ? (key >> 3) & 7 : 0;
+}
+
+static constexpr uint8_t dmode(const uint8_t key) {
+  return key & 7;
+}
+
+static constexpr uint8_t key(const uint16_t instr) {
+  return ((instr >> 9) & 0100) | ((instr >> 6) & 070) | ((instr >> 3) & 7);
+}
+
+template <uint8_t... K>
+struct keys {};
+
+template <uint8_t N, uint8_t... K>
+struct allkeys : allkeys<N - 1, N - 1, K...> {};
+
+template <uint8_t... K>
+struct allkeys<0, K...> {
+  typedef keys<K...> type;
+};
+
+struct specializations {
+  handler fn[NKEYS];
+};
+
+#define X(mask, value, name, flag, b, fn)
+#define T(mask, value, name, flag, b, fn) \
+  template <uint8_t... K> \
+  static constexpr specializations fn##s(keys<K...>) { \
+    return { { fn<width(b, K), smode(flag, K), dmode(K)>... } }; \
+  }
+INSTRUCTIONS(X, T)
+#undef X
+#undef T
+
+struct opcode {
+  uint16_t mask;
+  uint16_t value;
+  uint8_t flags;
+  handler fn;
+  specializations specialized;
+};
+
+static constexpr opcode opcodes[] = {
+#define X(mask, value, name, flag, b, fn) { mask, value, flag, fn, {} },
+#define T(mask, value, name, flag, b, fn) { mask, value, flag, NULL, fn##s(allkeys<NKEYS>::type()) },
+  INSTRUCTIONS(X, T)
+#undef X
+#undef T
+};
+
+static constexpr opcode invalid = { 0, 0, 0, INVAL, {} };
+
+static constexpr const opcode &lookup(const uint16_t instr) {
+  for (const opcode &o : opcodes) {
+    if ((instr & o.mask) == o.value) {
+      return o;
+    }
   }
-  if (((instr & 0177000) == 0104000) || (instr == 3) || (instr == 4)) { // EMT TRAP IOT BPT
-    EMTX(instr);
-    return;
+  return invalid;
+}
+
+static constexpr handler handlerfor(const uint16_t instr) {
+  return lookup(instr).fn ? lookup(instr).fn : lookup(instr).specialized.fn[key(instr)];
+}
+
+// The dispatch table is indexed by the top thirteen bits of the
+// instruction, which hold the addressing modes the handlers are
+// specialized on. The few blocks of 8 instructions that are also decoded
+// on their low three bits are dispatched again through a second level
+// table.
+static constexpr uint16_t groups[] = { 0000000, 0170010 };
+
+enum { NGROUPS = sizeof(groups) / sizeof(groups[0]) };
+
+static constexpr bool grouped(const uint16_t block) {
+  for (const uint16_t g : groups) {
+    if ((g >> 3) == block) {
+      return true;
+    }
   }
-  if ((instr & 0177740) == 0240) { // CL?, SE?
-    if (instr & 020) {
-      PS |= instr & 017;
+  return false;
+}
+
+// grouped instructions must not have operands, flags[] only has
+// an entry per block of 8.
+static constexpr bool groupscovered() {
+  for (const opcode &o : opcodes) {
+    if ((o.mask & 07) && ((o.mask & 0177770) != 0177770 || !grouped(o.value >> 3) || (o.flags & (S | DD)))) {
+      return false;
     }
-    else {
-      PS &= ~instr & 017;
+  }
+  return true;
+}
+
+static_assert(groupscovered(), "an INSTRUCTIONS entry decodes low bits outside groups[]");
+
+template <uint8_t G>
+static void group(const decoded &in);
+
+struct optable {
+  handler op[8192];
+  uint8_t flags[8192];
+  handler group[NGROUPS][8];
+};
+
+template <uint8_t... G>
+static constexpr optable makeoptab() {
+  static_assert(sizeof...(G) == NGROUPS, "one group handler per groups[] entry");
+  optable t = {};
+  for (uint16_t i = 0; i < 8192; i++) {
+    t.op[i] = handlerfor(i << 3);
+    t.flags[i] = lookup(i << 3).flags;
+  }
+  const handler groupfn[] = { group<G>... };
+  for (uint8_t g = 0; g < NGROUPS; g++) {
+    t.op[groups[g] >> 3] = groupfn[g];
+    for (uint8_t j = 0; j < 8; j++) {
+      t.group[g][j] = handlerfor(groups[g] | j);
     }
+  }
+  return t;
+}
+
+static constexpr optable optab ROM = makeoptab<0, 1>();
+
+template <uint8_t G>
+static void group(const decoded &in) {
+  romread(&optab.group[G][in.d & 7])(in);
+}
+
+static void predecode(decoded &in, const uint16_t instr) {
+  in.fn = romread(&optab.op[instr >> 3]);
+  in.instr = instr;
+  in.s = (instr >> 6) & 077;
+  in.d = instr & 077;
+  in.nimm = 0;
+}
+
+#if !defined(__AVR__)
+
+// streamwords returns the number of instruction stream words operand v
+// reads, or 3 if it steps the PC backwards. nstream adds them up for
+// both operands of in.
+static uint8_t streamwords(const uint8_t v) {
+  if ((v & 7) == 7) {
+    return (v & 040) ? ((v & 020) ? 1 : 3) : ((v & 020) ? 1 : 0);
+  }
+  return (v & 060) == 060 ? 1 : 0;
+}
+
+// The words following the instruction at pa are kept in in.imm if they
+// are in the same 64 byte block, which guarantees they are mapped the
+// same way as the instruction. Instructions that step the PC backwards
+// with -(PC) are not worth the trouble.
+static uint8_t nstream(const decoded &in) {
+  const uint8_t flags = romread(&optab.flags[in.instr >> 3]);
+  uint8_t n = 0;
+  if (flags & S) {
+    n += streamwords(in.s);
+  }
+  if (flags & DD) {
+    n += streamwords(in.d);
+  }
+  return n;
+}
+
+static void predecodeimm(decoded &in, const uint32_t pa) {
+  const uint8_t n = nstream(in);
+  if (n == 0 || n > 2 || (pa & 077) + 2 * n > 076) {
     return;
   }
-  switch (instr & 7) {
-    case 00: // HALT
-      if (curuser) {
-        break;
-      }
-      Serial.println(F("HALT"));
-      panic();
-    case 01: // WAIT
-      if (curuser) {
-        break;
-      }
-      return;
-    case 02: // RTI
+  for (uint8_t i = 0; i < n; i++) {
+    in.imm[i] = hal::read16(pa + 2 * (i + 1));
+  }
+  in.nimm = n;
+}
 
-    case 06: // RTT
-      RTT(instr);
-      return;
-    case 05: // RESET
-      RESET(instr);
-      return;
+static decoded &fetch(const uint32_t pa) {
+  decoded &in = m->icache[pa >> 1];
+  if (!in.fn) {
+    predecode(in, hal::read16(pa));
+    predecodeimm(in, pa);
+    m->codeblocks[pa >> 6] = 1;
+  }
+  return in;
+}
+
+// The block interpreter translates runs of instructions into blocks of
+// cells, each a copy of the decoded instruction and the address of the
+// code in run() that executes it. A block ends at the first instruction
+// that may transfer control, or at the end of its 64 byte block of RAM
+// so all of it is mapped the same way as its first instruction. Blocks
+// are dropped when their RAM is written, and when the mapping they were
+// translated under changes.
+// Blocks entered JITHOT times are handed to the JIT.
+enum { JITHOT = 64 };
+
+void flushblock(const uint32_t a) {
+  decoded *in = &m->icache[(a & ~077) >> 1];
+  block **b = &m->blocks[(a & ~077) >> 1];
+  for (uint8_t i = 0; i < 32; i++) {
+    // the rest of the entry may still be in use by the running instruction.
+    in[i].fn = NULL;
+    if (b[i]) {
+      b[i]->gen = 0;
+    }
+  }
+  m->codeblocks[a >> 6] = 0;
+  m->exitblock = true;
+}
+
+#endif
+
+// execute runs in, the instruction at pa, for step.
+static inline void execute(const decoded &in, const uint32_t pa) {
+  if (PRINTSTATE) printstate();
+#if !defined(__AVR__)
+  if (PROFILE) prof::count(pa, in.instr);
+  if (TRACE) {
+    const uint8_t n = nstream(in);
+    trace::begin(n <= 2 ? n : 0);
+    const uint16_t ps = psw();
+    in.fn(in);
+    trace::record(ps, pa, in);
+    return;
+  }
+#endif
+  in.fn(in);
+}
+
+void step() {
+  m->PC = m->R[7];
+  const uint32_t pa = mmu::decode(m->PC, false, m->curuser, false);
+  if (m->trapped) {
+    return;
   }
-  if (instr == 0170011) { // SETD ; not needed by UNIX, but used; therefore ignored
+  m->lit = NOLIT;
+#if !defined(__AVR__)
+  if ((pa < MEMSIZE) && !(pa & 1)) {
+    const decoded &in = fetch(pa);
+    m->R[7] += 2;
+    m->imm = in.imm;
+    m->nimm = in.nimm;
+    execute(in, pa);
     return;
   }
-  Serial.println("invalid instruction");
-  longjmp(trapbuf, INTINVAL);
+#endif
+  decoded in;
+  predecode(in, unibus::read16(pa));
+  if (m->trapped) {
+    return;
+  }
+  m->R[7] += 2;
+  m->nimm = 0;
+  execute(in, pa);
+}
+
+// steps runs up to max instructions one at a time, it stops early
+// where run does.
+static uint16_t steps(const uint16_t max) {
+  uint16_t n = 0;
+  do {
+    step();
+    n++;
+  } while ((n < max) && !m->trapped && !m->waiting && !m->scheduled && !interruptdue());
+  return n;
+}
+
+#if defined(__AVR__)
+
+uint16_t run(const uint16_t max) {
+  return steps(max);
+}
+
+#else
+
+// A block that ends in one of these pairs runs them as a superinstruction
+// with a single dispatch. The second instruction is specialized on the
+// kind of operation the first leaves in cc, so a branch is decided
+// straight from its operands and result without working out PS.
+template <uint8_t OP>
+static void BXXAFTER(const decoded &in) {
+  const uint8_t c = ((in.instr >> 12) & 010) | ((in.instr >> 8) & 7);
+  if ((branches.t[c] >> ccflags(OP)) & 1) {
+    branch(in.instr & 0xFF);
+  }
+}
+
+struct fusion {
+  const char *name;
+  uint16_t mask;    // the first instruction
+  uint16_t value;
+  handler second;   // handler of the second instruction
+  handler fused;    // replaces it
+};
+
+static const fusion fusions[] = {
+  { "TST Bxx",           0077700, 0005700, BXX, BXXAFTER<CCTST> },
+  { "CMP Bxx",           0070000, 0020000, BXX, BXXAFTER<CCCMP> },
+  { "BIT Bxx",           0070000, 0030000, BXX, BXXAFTER<CCNZ> },
+  { "DEC Bxx",           0077700, 0005300, BXX, BXXAFTER<CCDEC> },
+  { "MOV (R)+,(R)+ SOB", 0077070, 0012020, SOB, SOB },
+};
+
+static_assert(NFUSIONS == sizeof(fusions) / sizeof(fusions[0]), "NFUSIONS is not the number of fusions");
+
+void fusereport() {
+  for (uint8_t i = 0; i < NFUSIONS; i++) {
+    xprintf("%-18s %lu\r\n", fusions[i].name, (unsigned long)m->fired[i]);
+  }
+}
+
+// fuse turns the last two cells of b into a superinstruction if they
+// are one of the fusions.
+static void fuse(block *b) {
+  if (b->n < 2) {
+    return;
+  }
+  cell &first = b->cells[b->n - 2];
+  cell &second = b->cells[b->n - 1];
+  for (uint8_t i = 0; i < NFUSIONS; i++) {
+    if (((first.in.instr & fusions[i].mask) == fusions[i].value) && (second.in.fn == fusions[i].second)) {
+      first.op = m->fuseop;
+      first.fuse = i;
+      second.in.fn = fusions[i].fused;
+      return;
+    }
+  }
+}
+
+static bool valid(const block *b, const uint16_t pc) {
+  return (b->gen == m->mapgen[m->curuser]) && (b->user == m->curuser) && (b->vpc == pc);
+}
+
+// ends reports whether the next instruction can only be found from R7
+// once in has run: it transfers control, or writes the PC as a register
+// destination or as the odd register of a MUL, DIV or ASHC pair.
+static bool ends(const decoded &in, const uint8_t flags) {
+  if (flags & CT) {
+    return true;
+  }
+  if ((flags & DD) && (in.d == 7)) {
+    return true;
+  }
+  return (flags & RR) && ((in.s & 7) >= 6);
+}
+
+// translate fills b, or a new block if b is NULL, with the instructions
+// starting at pa, which the PC maps to.
+static block *translate(block *b, const uint32_t pa) {
+  if (!b) {
+    if ((m->nblocks == NBLOCKS) || jit::full()) {
+      // start over rather than track which blocks, or which of their
+      // code, are still in use.
+      memset(m->blocks, 0, sizeof(m->blocks));
+      m->nblocks = 0;
+      m->epoch++;
+      jit::reset();
+    }
+    b = &m->pool[m->nblocks++];
+    m->blocks[pa >> 1] = b;
+  }
+  b->vpc = m->R[7];
+  b->user = m->curuser;
+  b->gen = m->mapgen[m->curuser];
+  b->next[0] = NULL;
+  b->next[1] = NULL;
+  b->hits = 0;
+  b->code = NULL;
+  uint32_t a = pa;
+  uint8_t n = 0;
+  for (;;) {
+    const decoded &in = fetch(a);
+    const uint8_t flags = romread(&optab.flags[in.instr >> 3]);
+    cell &c = b->cells[n++];
+    c.op = m->execop;
+    c.pc = b->vpc + (a - pa);
+    c.in = in;
+    uint8_t words = 1;
+    if (flags & S) {
+      words += streamwords(in.s);
+    }
+    if (flags & DD) {
+      words += streamwords(in.d);
+    }
+    a += 2 * words;
+    if (ends(in, flags) || (words > 3) || (n == BLOCKMAX) || ((a & ~077) != (pa & ~077))) {
+      c.op = m->lastop;
+      b->n = n;
+      fuse(b);
+      return b;
+    }
+  }
+}
+
+void exec(const cell &c) {
+  m->PC = c.pc;
+  m->R[7] = c.pc + 2;
+  m->imm = c.in.imm;
+  m->nimm = c.in.nimm;
+  m->lit = NOLIT;
+
+  if (PRINTSTATE) printstate();
+
+  c.in.fn(c.in);
+}
+
+void trace(const cell &c) {
+  m->PC = c.pc;
+  m->R[7] = c.pc + 2;
+  printstate();
+}
+
+// begin starts the instruction in c, R7 is its address.
+static inline void begin(const cell &c) {
+  m->PC = m->R[7];
+  m->R[7] += 2;
+  m->imm = c.in.imm;
+  m->nimm = c.in.nimm;
+  m->lit = NOLIT;
+
+  if (PRINTSTATE) printstate();
+}
+
+// m->from is the block the last run() ended in without finding a link
+// to the block after it, run() links the two when it is next called.
+
+uint16_t run(const uint16_t max) {
+  // the profiler and the trace see instructions as step runs them.
+  if (!THREADED || PROFILE || TRACE) {
+    return steps(max);
+  }
+  m->execop = &&exec;
+  m->lastop = &&last;
+  m->fuseop = &&fuse;
+
+  m->PC = m->R[7];
+  const uint32_t pa = mmu::decode(m->PC, false, m->curuser, false);
+  if (m->trapped) {
+    // a fault fetching the instruction counts as one, as it does in
+    // steps.
+    return 1;
+  }
+  if ((pa >= MEMSIZE) || (pa & 1)) {
+    m->from = NULL;
+    step();
+    return 1;
+  }
+  block *b = m->blocks[pa >> 1];
+  if (!b || !valid(b, m->PC)) {
+    b = translate(b, pa);
+  }
+  if (m->from && (m->fromepoch == m->epoch)) {
+    m->from->next[m->from->next[0] != NULL] = b;
+  }
+  m->from = NULL;
+
+  m->exitblock = false;
+  uint16_t n = 0;
+  const cell *c;
+
+enter:
+  if (b->n > max - n) {
+    // b would overrun max, only as many of its instructions as fit are
+    // run, one at a time.
+    for (c = b->cells; n < max; c++) {
+      exec(*c);
+      n++;
+      if (m->exitblock) {
+        break;
+      }
+    }
+    return n;
+  }
+  if (JIT) {
+    if (b->code) {
+      n += b->code();
+      goto next;
+    }
+    if (++b->hits == JITHOT) {
+      b->code = jit::compile(*b);
+    }
+  }
+  c = b->cells;
+  goto *c->op;
+
+exec:
+  begin(*c);
+  c->in.fn(c->in);
+  n++;
+  if (m->exitblock) {
+    return n;
+  }
+  c++;
+  goto *c->op;
+
+fuse:
+  begin(*c);
+  c->in.fn(c->in);
+  n++;
+  if (m->exitblock) {
+    return n;
+  }
+  if (FUSESTATS) {
+    m->fired[c->fuse]++;
+  }
+  c++;
+  // fall through to the second instruction, the last of the block.
+
+last:
+  begin(*c);
+  c->in.fn(c->in);
+  n++;
+
+next:
+  if (m->exitblock || (n >= max) || interruptdue()) {
+    return n;
+  }
+  for (uint8_t i = 0; i < 2; i++) {
+    if (b->next[i] && valid(b->next[i], m->R[7])) {
+      b = b->next[i];
+      goto enter;
+    }
+  }
+  m->from = b;
+  m->fromepoch = m->epoch;
+  return n;
+}
+
+#endif
+
+// taketraps takes the trap the last instruction raised, and any trap
+// taking it raises in turn.
+void taketraps() {
+  while (m->trapped) {
+    const uint16_t vec = m->trapped;
+    m->trapped = 0;
+    m->traps++;
+    trapat(vec);
+  }
 }
 
 void trapat(uint16_t vec) { // , msg string) {
   if (vec & 1) {
-    Serial.println(F("Thou darst calling trapat() with an odd vector number?"));
+    xprintf("Thou darst calling trapat() with an odd vector number?\r\n");
     panic();
   }
-  Serial.print(F("trap: ")); Serial.println(vec, OCT);
+#if !defined(__AVR__)
+  m->trapcount[(vec >> 1) & 127]++;
+#endif
+  xprintf("trap: %o\r\n", vec);
   //printstate();
 
   /*var prev uint16
@@ -1170,83 +1884,85 @@ void trapat(uint16_t vec) { // , msg string) {
    			panic(t)
    		}
    */
-  uint16_t prev = PS;
+  const uint16_t prev = psw();
   switchmode(false);
   push(prev);
-  push(R[7]);
+  if (m->trapped) {
+    return;
+  }
+  push(m->R[7]);
+  if (m->trapped) {
+    return;
+  }
 
-  R[7] = unibus::read16(vec);
-  PS = unibus::read16(vec + 2);
-  if (prevuser) {
-    PS |= (1 << 13) | (1 << 12);
+  m->R[7] = unibus::read16(vec);
+  m->PS = unibus::read16(vec + 2);
+  if (m->prevuser) {
+    m->PS |= (1 << 13) | (1 << 12);
   }
 }
 
+// interrupt posts an interrupt to vec at priority pri, BR4 to BR7. A
+// vector is only ever pending once, posting it again while it is does
+// nothing, so the controller cannot overflow.
 void interrupt(uint8_t vec, uint8_t pri) {
   if (vec & 1) {
-    Serial.println(F("Thou darst calling interrupt() with an odd vector number?"));
+    xprintf("Thou darst calling interrupt() with an odd vector number?\r\n");
     panic();
   }
-  // fast path
-  if (itab[0].vec == 0) {
-    itab[0].vec = vec;
-    itab[0].pri = pri;
-    return;
-  }
-  uint8_t i;
-  for (i = 0; i < ITABN; i++) {
-    if ((itab[i].vec == 0) || (itab[i].pri < pri)) {
-      break;
-    }
-  }
-  for (; i < ITABN; i++) {
-    if ((itab[i].vec == 0) || (itab[i].vec >= vec)) {
-      break;
-    }
-  }
-  if (i >= ITABN) {
-    Serial.println(F("interrupt table full")); panic();
-  }
-  uint8_t j;
-  for (j = i + 1; j < ITABN; j++) {
-    itab[j] = itab[j - 1];
+  if ((pri < 4) || (pri > 7)) {
+    xprintf("interrupt: invalid priority %d\r\n", pri);
+    panic();
   }
-  itab[i].vec = vec;
-  itab[i].pri = pri;
+  const uint8_t w = vec >> 6;
+  m->irqvecs[pri - 4][w] |= 1UL << ((vec >> 1) & 31);
+  m->irqwords[pri - 4] |= 1 << w;
+  m->irqlevels |= 1 << pri;
 }
 
-// pop the top interrupt off the itab.
-static void popirq() {
-  uint8_t i;
-  for (i = 0; i < ITABN - 1; i++) {
-    itab[i] = itab[i + 1];
+// takeirq returns the vector of the interrupt to take next, the lowest
+// pending at the highest priority, and drops it.
+static uint8_t takeirq() {
+  uint8_t pri = 7;
+  while (!(m->irqlevels & (1 << pri))) {
+    pri--;
+  }
+  const uint8_t w = __builtin_ctz(m->irqwords[pri - 4]);
+  uint32_t &vecs = m->irqvecs[pri - 4][w];
+  const uint8_t b = __builtin_ctzl(vecs);
+  vecs &= vecs - 1;
+  if (!vecs) {
+    m->irqwords[pri - 4] &= ~(1 << w);
+    if (!m->irqwords[pri - 4]) {
+      m->irqlevels &= ~(1 << pri);
+    }
   }
-  itab[ITABN - 1].vec = 0;
-  itab[ITABN - 1].pri = 0;
+  return (w << 6) | (b << 1);
 }
 
 void handleinterrupt() {
-  uint8_t vec = itab[0].vec;
+  const uint8_t vec = takeirq();
+  m->interrupts++;
+#if !defined(__AVR__)
+  m->irqcount[vec >> 1]++;
+#endif
   if (DEBUG_INTER) {
-    Serial.print("IRQ: "); Serial.println(vec, OCT);
+    xprintf("IRQ: %o\r\n", vec);
   }
-  uint16_t vv = setjmp(trapbuf);
-  if (vv == 0) {
-    uint16_t prev = PS;
-    switchmode(false);
-    push(prev);
-    push(R[7]);
-  } else {
-    trapat(vv);
+  const uint16_t prev = psw();
+  switchmode(false);
+  push(prev);
+  if (!m->trapped) {
+    push(m->R[7]);
   }
+  taketraps();
 
 
-  R[7] = unibus::read16(vec);
-  PS = unibus::read16(vec + 2);
-  if (prevuser) {
-    PS |= (1 << 13) | (1 << 12);
+  m->R[7] = unibus::read16(vec);
+  m->PS = unibus::read16(vec + 2);
+  if (m->prevuser) {
+    m->PS |= (1 << 13) | (1 << 12);
   }
-  popirq();
 }
 
 };
@@ -1,61 +1,131 @@
-// this is all kinds of wrong
-#include <setjmp.h>
+enum {
+  FLAGN = 8,
+  FLAGZ = 4,
+  FLAGV = 2,
+  FLAGC = 1
+};
 
-extern jmp_buf trapbuf;
+namespace cpu {
 
-namespace pdp11 {
-struct intr {
-  uint8_t vec;
-  uint8_t pri;
+struct decoded;
+typedef void (*handler)(const decoded &in);
+
+// decoded is an instruction broken out for its handler.
+struct decoded {
+  handler fn;
+  uint16_t instr;
+  uint8_t s;        // source operand, mode << 3 | register
+  uint8_t d;        // destination operand
+  uint8_t nimm;     // number of words in imm
+  uint16_t imm[2];  // the instruction stream words following instr
 };
+
+// The condition codes of the last ALU instruction, see psw().
+struct ccrecord {
+  uint8_t op;
+  uint8_t l;
+  uint16_t src;
+  uint16_t dst;
+  uint16_t res;
 };
 
-#define ITABN 8
+enum {
+  CCPS,       // PS holds the condition codes
+  CCNZ,       // MOV, BIT, BIC, BIS, XOR
+  CCINC,
+  CCDEC,
+  CCTST = 8,  // TST, CLR
+  CCCOM,
+  CCNEG,
+  CCCMP,
+  CCADD,
+  CCSUB
+};
 
-extern pdp11::intr itab[ITABN];
+#if !defined(__AVR__)
+void flushblock(uint32_t a);
 
+// The block interpreter runs translated blocks of cells, see run().
+// It keeps NBLOCKS of them, of up to BLOCKMAX cells.
+enum { BLOCKMAX = 8, NBLOCKS = 16384 };
 
-enum {
-  FLAGN = 8,
-  FLAGZ = 4,
-  FLAGV = 2,
-  FLAGC = 1
+struct cell {
+  const void *op;  // code in run() that executes in
+  uint16_t pc;     // virtual address of the instruction
+  uint8_t fuse;    // the superinstruction op runs, see fusions
+  decoded in;
 };
 
-namespace cpu {
+// native is a block compiled by the JIT, it returns the number of
+// instructions it ran.
+typedef uint8_t (*native)();
+
+struct block {
+  uint16_t vpc;    // virtual address of the first instruction
+  bool user;       // mode the block was translated in
+  uint8_t n;       // number of cells
+  uint32_t gen;    // mapgen[user] when translated, 0 once dropped
+  block *next[2];  // blocks run() went on to after this one
+  uint16_t hits;   // times run() entered the block
+  native code;     // the compiled block, or NULL
+  cell cells[BLOCKMAX];
+};
 
-extern int32_t R[8];
+// Code compiled by the JIT calls exec to run an instruction it does not
+// translate itself, keepcarry before it records an operation that
+// leaves C alone, and trace in place of printstate.
+void exec(const cell &c);
+void keepcarry();
+void trace(const cell &c);
 
-extern uint16_t PC;
-extern uint16_t PS;
-extern uint16_t USP;
-extern uint16_t KSP;
-extern uint16_t LKS;
-extern bool curuser;
-extern bool prevuser;
+// fusereport prints how often each of the NFUSIONS superinstructions
+// ran.
+enum { NFUSIONS = 5 };
+void fusereport();
+#endif
 
 void step();
+// run executes up to max instructions, and returns how many it ran.
+// It returns early after one that traps, waits, schedules an event or
+// lets an interrupt in.
+uint16_t run(uint16_t max);
 void reset(void);
 void switchmode(bool newm);
 
+// readreg and writereg access the CPU's registers in the I/O page, the
+// PS and the switch register.
+uint16_t readreg(uint32_t a);
+void writereg(uint32_t a, uint16_t v);
+
+// The condition codes in PS are evaluated lazily, psw returns PS with
+// them up to date. setpsw replaces the whole PS.
+uint16_t psw();
+void setpsw(uint16_t v);
+
+// trap raises a trap to vec. The running instruction is aborted: the
+// accessors stop touching memory and handlers return early once
+// m->trapped is set, and taketraps then takes the trap through trapat.
+void trap(uint16_t vec);
+void taketraps();
+
 void trapat(uint16_t vec);
 void interrupt(uint8_t vec, uint8_t pri);
 void handleinterrupt();
 
-static bool N() {
-  return (uint8_t)PS & FLAGN;
+static inline bool N() {
+  return (uint8_t)psw() & FLAGN;
 }
 
-static bool Z() {
-  return (uint8_t)PS & FLAGZ;
+static inline bool Z() {
+  return (uint8_t)psw() & FLAGZ;
 }
 
-static bool V() {
-  return (uint8_t)PS & FLAGV;
+static inline bool V() {
+  return (uint8_t)psw() & FLAGV;
 }
 
-static bool C() {
-  return (uint8_t)PS & FLAGC;
+static inline bool C() {
+  return (uint8_t)psw() & FLAGC;
 }
 
 };
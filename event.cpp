@@ -0,0 +1,62 @@
+#include "hal.h"
+#include "avr11.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+
+namespace event {
+
+void schedule(const uint8_t ev, const uint32_t delay) {
+  m->due[ev] = m->now + delay;
+  m->pending |= 1 << ev;
+  m->scheduled |= 1 << ev;
+#if !defined(__AVR__)
+  m->exitblock = true;
+#endif
+}
+
+void cancel(const uint8_t ev) {
+  m->pending &= ~(1 << ev);
+}
+
+// Times are compared as the difference from now, so they can wrap.
+uint32_t next() {
+  uint32_t d = 0xFFFFFFFF;
+  for (uint8_t ev = 0; ev < N; ev++) {
+    if (m->pending & (1 << ev)) {
+      const int32_t left = m->due[ev] - m->now;
+      if (left <= 0) {
+        return 0;
+      }
+      if ((uint32_t)left < d) {
+        d = left;
+      }
+    }
+  }
+  return d;
+}
+
+uint8_t take() {
+  for (uint8_t ev = 0; ev < N; ev++) {
+    if ((m->pending & (1 << ev)) && (int32_t)(m->due[ev] - m->now) <= 0) {
+      m->pending &= ~(1 << ev);
+      return ev;
+    }
+  }
+  return N;
+}
+
+// The CPU stops after an instruction that schedules an event, but the
+// event was timed from when the CPU started, n instructions ago.
+void ran(const uint16_t n) {
+  m->now += n;
+  for (uint8_t ev = 0; ev < N; ev++) {
+    if (m->scheduled & (1 << ev)) {
+      m->due[ev] += n;
+    }
+  }
+  m->scheduled = 0;
+}
+
+};
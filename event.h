@@ -0,0 +1,33 @@
+// The devices schedule what they do next as events, each due a number
+// of instructions from now. machine::run stops the CPU when the next
+// event is due and fires it, see avr11.cpp.
+//
+// A device has at most one event pending, so the queue is a time for
+// each event and a bit saying whether it is pending.
+namespace event {
+
+enum {
+  CLOCK,   // the line clock ticks
+  TTYIN,   // the console looks for input from the host
+  TTYOUT,  // the console has output TPB
+  RK,      // the RK05 transfer is done
+  N
+};
+
+// schedule makes ev due delay instructions from now, in place of when
+// it was due before. The CPU stops after the instruction that does it.
+void schedule(uint8_t ev, uint32_t delay);
+void cancel(uint8_t ev);
+
+// next returns the number of instructions until the next event is due.
+uint32_t next();
+
+// take returns an event that is due and drops it, or N if none is.
+// Events due at the same time are taken in the order they are listed.
+uint8_t take();
+
+// ran moves time on by the n instructions the CPU ran since the last
+// call, and events it scheduled while doing so with it.
+void ran(uint16_t n);
+
+};
@@ -0,0 +1,131 @@
+// hal is the hardware abstraction layer. The emulator core reaches the
+// console, the RK05 image, guest RAM and the status pins only through
+// these functions. hal_avr.cpp implements them for the Arduino Mega with
+// the QuadRAM shield and an SD card, hal_linux.cpp for a POSIX host.
+
+#include <stdint.h>
+#include <stdio.h>
+
+// xprintf is printf, with the format string kept in flash on AVR.
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#include "xmem.h"
+#define xprintf(fmt, ...) printf_P(PSTR(fmt), ##__VA_ARGS__)
+#else
+#define xprintf(fmt, ...) printf(fmt, ##__VA_ARGS__)
+#endif
+
+// ROM keeps a constant table in flash on AVR instead of copying it to
+// SRAM at startup, romread reads an element back.
+#if defined(__AVR__)
+#define ROM PROGMEM
+template <typename T>
+static inline T romread(const T *p) {
+  T v;
+  memcpy_P(&v, p, sizeof(T));
+  return v;
+}
+#else
+#define ROM
+template <typename T>
+static inline T romread(const T *p) {
+  return *p;
+}
+#endif
+
+// guest RAM occupies physical addresses [0, MEMSIZE), the rest of the
+// 18 bit address space of the 11/40, or the 22 bit one of the 11/70, is
+// the I/O page at IOPAGE. See PDP1170 in avr11.h.
+#define MEMSIZE (PDP1170 ? 017760000 : 0760000)
+#define IOPAGE MEMSIZE
+
+struct machine;
+
+namespace hal {
+
+void begin();
+void halt() __attribute__((noreturn));
+
+// console
+bool charavailable();
+uint8_t readchar();
+void writechar(uint8_t c);
+
+// idle blocks for up to us microseconds, returning early when a
+// character is available, and returns how long it blocked.
+uint32_t idle(uint32_t us);
+
+// RK05 disk image
+bool diskopen(const char *name);
+bool diskseek(uint32_t pos);
+uint8_t diskread();
+// diskwrite reports whether b was written.
+bool diskwrite(uint8_t b);
+
+#if defined(__AVR__)
+
+void diskled(bool on);
+void stepled(bool on);
+
+// Each 32k xmem bank is mapped at 0x2200.
+static inline uint8_t bank(const uint32_t a) {
+  // This shift costs 1 Khz of simulated performance,
+  // at least 4 usec / instruction.
+  // return a >> 15;
+  char * aa = (char *)&a;
+  return ((aa[2] & 3)<<1) | (((aa)[1] & (1<<7))>>7);
+}
+
+static inline uint16_t read16(const uint32_t a) {
+  xmem::setMemoryBank(bank(a), false);
+  return reinterpret_cast<uint16_t *>(0x2200)[(a & 0x7fff) >> 1];
+}
+
+static inline void write16(const uint32_t a, const uint16_t v) {
+  xmem::setMemoryBank(bank(a), false);
+  reinterpret_cast<uint16_t *>(0x2200)[(a & 0x7fff) >> 1] = v;
+}
+
+static inline void write8(const uint32_t a, const uint8_t v) {
+  xmem::setMemoryBank(bank(a), false);
+  reinterpret_cast<uint8_t *>(0x2200)[a & 0x7fff] = v;
+}
+
+#else
+
+// console makes mc the one machine that reads stdin, see hal_linux.cpp.
+void console(machine *mc);
+
+// diskfork gives child the disk of the calling thread's machine as it is
+// now. From then on each keeps the sectors it writes in memory, copied
+// on write, and reads the rest from the image, which is no longer
+// written.
+bool diskfork(machine *child);
+
+// diskfree drops mc's sectors and frees its sector table. A sector is
+// freed with the last machine that holds it, the image is kept.
+void diskfree(machine *mc);
+
+// the host has no status pins.
+static inline void diskled(bool on) {}
+static inline void stepled(bool on) {}
+
+// ram is the memory of the machine the calling thread emulates, see
+// machine::bind.
+extern __thread uint16_t *ram;
+
+static inline uint16_t read16(const uint32_t a) {
+  return ram[a >> 1];
+}
+
+static inline void write16(const uint32_t a, const uint16_t v) {
+  ram[a >> 1] = v;
+}
+
+static inline void write8(const uint32_t a, const uint8_t v) {
+  reinterpret_cast<uint8_t *>(ram)[a] = v;
+}
+
+#endif
+
+};
@@ -0,0 +1,98 @@
+#if defined(__AVR__)
+
+#include <Arduino.h>
+#include <SdFat.h>
+#include "hal.h"
+#include "xmem.h"
+
+namespace hal {
+
+static int serialWrite(char c, FILE *f) {
+  Serial.write(c);
+  return 0;
+}
+
+SdFat sd;
+SdFile rkdata;
+
+void begin() {
+  // setup all the SPI pins, ensure all the devices are deselected
+  pinMode(4, OUTPUT); digitalWrite(4, HIGH);
+  pinMode(10, OUTPUT); digitalWrite(10, HIGH);
+  pinMode(13, OUTPUT); digitalWrite(13, LOW);  // rk11
+  pinMode(53, OUTPUT); digitalWrite(53, HIGH);
+  pinMode(18, OUTPUT); digitalWrite(18, LOW); // timing interrupt, high while CPU is stepping
+
+  // Start the UART
+  Serial.begin(19200) ;
+  fdevopen(serialWrite, NULL);
+
+  Serial.println(F("Reset"));
+
+  // Xmem test
+  xmem::SelfTestResults results;
+
+  xmem::begin(false);
+  results = xmem::selfTest();
+  if (!results.succeeded) {
+    Serial.println(F("xram test failure"));
+    halt();
+  }
+
+  // Initialize SdFat or print a detailed error message and halt
+  // Use half speed like the native library.
+  // change to SPI_FULL_SPEED for more performance.
+  if (!sd.begin(4, SPI_FULL_SPEED)) sd.initErrorHalt();
+}
+
+void halt() {
+  for (;;) delay(1);
+}
+
+bool charavailable() {
+  return Serial.available();
+}
+
+uint8_t readchar() {
+  return Serial.read();
+}
+
+void writechar(const uint8_t c) {
+  Serial.write(c);
+}
+
+uint32_t idle(const uint32_t us) {
+  const uint32_t start = micros();
+  while (!Serial.available() && (micros() - start < us)) {
+  }
+  const uint32_t slept = micros() - start;
+  return slept < us ? slept : us;
+}
+
+bool diskopen(const char *name) {
+  return rkdata.open(name, O_RDWR);
+}
+
+bool diskseek(const uint32_t pos) {
+  return rkdata.seekSet(pos);
+}
+
+uint8_t diskread() {
+  return rkdata.read();
+}
+
+bool diskwrite(const uint8_t b) {
+  return rkdata.write(b) == 1;
+}
+
+void diskled(const bool on) {
+  digitalWrite(13, on);
+}
+
+void stepled(const bool on) {
+  digitalWrite(18, on);
+}
+
+};
+
+#endif
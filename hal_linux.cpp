@@ -0,0 +1,329 @@
+#if !defined(__AVR__)
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "hal.h"
+#include "avr11.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+#include "trace.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "bench.h"
+
+void setup();
+void loop();
+
+namespace hal {
+
+__thread uint16_t *ram;
+
+// path of the RK05 image, overrides the name passed to diskopen.
+static const char *diskpath;
+
+static struct termios saved;
+static bool restore;
+
+static void resetterminal() {
+  if (restore) {
+    tcsetattr(0, TCSANOW, &saved);
+  }
+}
+
+void begin() {
+  setvbuf(stdout, NULL, _IONBF, 0);
+  // pass keystrokes through as they are typed, but leave ^C alone.
+  if (isatty(0) && tcgetattr(0, &saved) == 0) {
+    struct termios t = saved;
+    t.c_lflag &= ~(ICANON | ECHO);
+    t.c_iflag &= ~ICRNL;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    restore = tcsetattr(0, TCSANOW, &t) == 0;
+    atexit(resetterminal);
+  }
+  printf("Reset\r\n");
+}
+
+void halt() {
+  exit(1);
+}
+
+// stdin is read by one machine, the one passed to console. The
+// console of every other, forked or benchmark, reads as at the end of
+// its input, so machines on other threads never race for a character.
+static machine *owner;
+static int pending = -1;
+static bool eof;
+static uint16_t pollcount;
+
+void console(machine *mc) {
+  owner = mc;
+}
+
+// readinput waits up to timeout for a character on stdin, as poll(2)
+// does, and keeps it in pending.
+static void readinput(const struct timespec *timeout) {
+  struct pollfd p = { 0, POLLIN, 0 };
+  if (ppoll(&p, 1, timeout, NULL) == 1) {
+    uint8_t c;
+    if (read(0, &c, 1) == 1) {
+      pending = c;
+    } else {
+      eof = true;
+    }
+  }
+}
+
+// charavailable is called every TTYPOLL instructions, a poll(2) each
+// time would dominate the runtime so stdin is only checked every
+// 1024 calls.
+bool charavailable() {
+  if (m != owner) {
+    return false;
+  }
+  if (pending >= 0) {
+    return true;
+  }
+  if (eof || (++pollcount & 01777)) {
+    return false;
+  }
+  const struct timespec now = { 0, 0 };
+  readinput(&now);
+  return pending >= 0;
+}
+
+static uint64_t usec() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+uint32_t idle(const uint32_t us) {
+  const bool reads = m == owner;
+  if (reads && (pending >= 0)) {
+    return 0;
+  }
+  const uint64_t start = usec();
+  const struct timespec timeout = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+  if (!reads || eof) {
+    nanosleep(&timeout, NULL);
+  } else {
+    readinput(&timeout);
+  }
+  const uint64_t slept = usec() - start;
+  return slept < us ? slept : us;
+}
+
+uint8_t readchar() {
+  const uint8_t c = pending;
+  pending = -1;
+  return c;
+}
+
+void writechar(const uint8_t c) {
+  putchar(c);
+}
+
+bool diskopen(const char *name) {
+  m->rkdata = fopen(diskpath ? diskpath : name, "r+b");
+  return m->rkdata != NULL;
+}
+
+// A forked machine reads the image with pread, the machines forked with
+// it share its FILE, and transfers a sector at a time through rksec.
+enum { SECTOR = 512, MAXSECTORS = 1 << 13 };
+
+// cowsector points rksec at the sector at rkpos.
+static bool cowsector() {
+  const uint32_t s = m->rkpos / SECTOR;
+  if (s >= MAXSECTORS) {
+    return false;
+  }
+  if (m->rkcow[s]) {
+    m->rksec = m->rkcow[s];
+    return true;
+  }
+  ssize_t n = pread(fileno(m->rkdata), m->rkbuf, SECTOR, (off_t)s * SECTOR);
+  if (n < 0) {
+    n = 0;
+  }
+  // past the end of the image reads as getc's EOF.
+  memset(m->rkbuf + n, 0xFF, SECTOR - n);
+  m->rksec = m->rkbuf;
+  return true;
+}
+
+// A sector in rkcow is followed by the number of sector tables that
+// hold it, which machines on any thread drop. A machine writes a sector
+// in place only while it is the one holder, and the last to drop it
+// frees it.
+static uint32_t *holders(uint8_t *sec) {
+  return (uint32_t *)(sec + SECTOR);
+}
+
+static void hold(uint8_t *sec) {
+  __atomic_add_fetch(holders(sec), 1, __ATOMIC_RELAXED);
+}
+
+static void drop(uint8_t *sec) {
+  if (__atomic_sub_fetch(holders(sec), 1, __ATOMIC_ACQ_REL) == 0) {
+    free(sec);
+  }
+}
+
+// own copies the sector at rkpos before it is written, unless the
+// machine is its one holder, and reports whether it could.
+static bool own() {
+  const uint32_t s = m->rkpos / SECTOR;
+  uint8_t *const sec = m->rkcow[s];
+  if (sec && (__atomic_load_n(holders(sec), __ATOMIC_ACQUIRE) == 1)) {
+    return true;
+  }
+  uint8_t *p = (uint8_t *)malloc(SECTOR + sizeof(uint32_t));
+  if (!p) {
+    return false;
+  }
+  memcpy(p, m->rksec, SECTOR);
+  *holders(p) = 1;
+  if (sec) {
+    drop(sec);
+  }
+  m->rkcow[s] = p;
+  m->rksec = p;
+  return true;
+}
+
+// advance moves rkpos on a byte, and off rksec at its end.
+static void advance() {
+  if (++m->rkpos % SECTOR == 0) {
+    m->rksec = NULL;
+  }
+}
+
+bool diskseek(const uint32_t pos) {
+  if (m->rkcow) {
+    m->rkpos = pos;
+    m->rksec = NULL;
+    return pos / SECTOR < MAXSECTORS;
+  }
+  return fseek(m->rkdata, pos, SEEK_SET) == 0;
+}
+
+uint8_t diskread() {
+  if (m->rkcow) {
+    if (!m->rksec && !cowsector()) {
+      return 0xFF;
+    }
+    const uint8_t b = m->rksec[m->rkpos % SECTOR];
+    advance();
+    return b;
+  }
+  return getc(m->rkdata);
+}
+
+bool diskwrite(const uint8_t b) {
+  if (m->rkcow) {
+    if ((!m->rksec && !cowsector()) || !own()) {
+      return false;
+    }
+    m->rksec[m->rkpos % SECTOR] = b;
+    advance();
+    return true;
+  }
+  return putc(b, m->rkdata) != EOF;
+}
+
+bool diskfork(machine *child) {
+  if (!m->rkcow) {
+    if (fflush(m->rkdata) != 0) {
+      return false;
+    }
+    m->rkcow = (uint8_t **)calloc(MAXSECTORS, sizeof(uint8_t *));
+    if (!m->rkcow) {
+      return false;
+    }
+  }
+  child->rkdata = m->rkdata;
+  child->rkcow = (uint8_t **)malloc(MAXSECTORS * sizeof(uint8_t *));
+  if (!child->rkcow) {
+    return false;
+  }
+  for (uint32_t s = 0; s < MAXSECTORS; s++) {
+    child->rkcow[s] = m->rkcow[s];
+    if (child->rkcow[s]) {
+      hold(child->rkcow[s]);
+    }
+  }
+  return true;
+}
+
+void diskfree(machine *mc) {
+  if (mc->rkcow) {
+    for (uint32_t s = 0; s < MAXSECTORS; s++) {
+      if (mc->rkcow[s]) {
+        drop(mc->rkcow[s]);
+      }
+    }
+  }
+  free(mc->rkcow);
+  mc->rkcow = NULL;
+  mc->rksec = NULL;
+}
+
+};
+
+// avr11 [-r log | -p log] [-s snap] [-l snap] [image] runs the
+// emulator, recording the console input to log or playing it back from
+// it, see replay.h. -s saves a snapshot to snap when SNAPKEY is typed,
+// -l resumes the one in snap in place of booting, see snapshot.h.
+// avr11 -t file decodes the trace in file, see trace.h.
+// avr11 -b runs the benchmarks, see bench.h.
+int main(int argc, char **argv) {
+  if ((argc > 2) && (strcmp(argv[1], "-t") == 0)) {
+    return trace::decode(argv[2]);
+  }
+  if ((argc > 1) && (strcmp(argv[1], "-b") == 0)) {
+    return bench::run();
+  }
+  const char *log = NULL;
+  bool record = false;
+  const char *save = NULL;
+  const char *resume = NULL;
+  for (; argc > 2; argc -= 2, argv += 2) {
+    if (!strcmp(argv[1], "-r") || !strcmp(argv[1], "-p")) {
+      record = argv[1][1] == 'r';
+      log = argv[2];
+    } else if (!strcmp(argv[1], "-s")) {
+      save = argv[2];
+    } else if (!strcmp(argv[1], "-l")) {
+      resume = argv[2];
+    } else {
+      break;
+    }
+  }
+  if (argc > 1) {
+    hal::diskpath = argv[1];
+  }
+  setup();
+  if (resume && !snapshot::load(resume)) {
+    printf("loading %s failed\r\n", resume);
+    hal::halt();
+  }
+  snapshot::arm(save);
+  if (log && !replay::start(log, record)) {
+    printf("opening %s failed\r\n", log);
+    hal::halt();
+  }
+  for (;;) {
+    loop();
+  }
+}
+
+#endif
@@ -0,0 +1,529 @@
+#if !defined(__AVR__)
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "hal.h"
+#include "avr11.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+#include "jit.h"
+
+namespace jit {
+
+#if defined(__x86_64__)
+
+// A compiled block keeps R0-R5 in the callee saved registers ebx, ebp
+// and r12d-r15d. R6 stays in m->R, and R7 is a constant at every
+// instruction of a block. Instructions that only read and write R0-R5
+// and immediates are translated to x86-64, they record their condition
+// codes in m->cc the way the handlers do. Every other instruction
+// is run by calling cpu::exec with R0-R5 written back to m->R, and
+// the block returns after it when it trapped or otherwise set
+// exitblock. The code addresses the state of the machine it was
+// compiled for, so only that machine runs it.
+
+enum {
+  CODESIZE = 16 << 20,  // bytes of executable memory
+  BLOCKCODE = 4096      // more than a compiled block can take
+};
+
+// Each machine has its own code, in m->jitcode. The state of a
+// compile is per thread.
+
+// p is where the next host instruction goes.
+static __thread uint8_t *p;
+
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI, R12 = 12, R13, R14, R15 };
+
+static const uint8_t hreg[6] = { EBX, EBP, R12, R13, R14, R15 };
+
+static void byte(const uint8_t b) {
+  *p++ = b;
+}
+
+static void word(const uint16_t w) {
+  memcpy(p, &w, sizeof(w));
+  p += sizeof(w);
+}
+
+static void dword(const uint32_t d) {
+  memcpy(p, &d, sizeof(d));
+  p += sizeof(d);
+}
+
+static void qword(const uint64_t q) {
+  memcpy(p, &q, sizeof(q));
+  p += sizeof(q);
+}
+
+// rex emits the REX prefix for the reg and rm fields of a ModRM byte,
+// if one is needed. Byte registers 4-7 are spl-dil only with a REX.
+static void rex(const uint8_t reg, const uint8_t rm, const bool force = false) {
+  const uint8_t r = 0x40 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+  if (force || r != 0x40) {
+    byte(r);
+  }
+}
+
+static void modrm(const uint8_t reg, const uint8_t rm) {
+  byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// alu emits op dst, src for an op r/m32, r32 opcode.
+static void alu(const uint8_t op, const uint8_t dst, const uint8_t src) {
+  rex(src, dst);
+  byte(op);
+  modrm(src, dst);
+}
+
+enum { ADD = 0x01, OR = 0x09, AND = 0x21, SUB = 0x29, XOR = 0x31, MOV = 0x89 };
+
+// movzx zero extends the low 16 bits of src, or the low 8 with b.
+static void movzx(const uint8_t dst, const uint8_t src, const bool b = false) {
+  rex(dst, src, b);
+  byte(0x0F);
+  byte(b ? 0xB6 : 0xB7);
+  modrm(dst, src);
+}
+
+static void movsx8(const uint8_t dst, const uint8_t src) {
+  rex(dst, src, true);
+  byte(0x0F);
+  byte(0xBE);
+  modrm(dst, src);
+}
+
+static void movimm(const uint8_t r, const uint32_t v) {
+  rex(0, r);
+  byte(0xB8 | (r & 7));
+  dword(v);
+}
+
+// group emits one of the instructions selected by the reg field of the
+// ModRM byte, such as and r32, imm32 (0x81 /4) or not r32 (0xF7 /2).
+static void group(const uint8_t op, const uint8_t ext, const uint8_t r) {
+  rex(0, r);
+  byte(op);
+  modrm(ext, r);
+}
+
+static void mask16(const uint8_t r) {
+  group(0x81, 4, r);
+  dword(0xFFFF);
+}
+
+static void movabs(const uint8_t r, const void *v) {
+  byte(0x48 | ((r & 8) ? 1 : 0));
+  byte(0xB8 | (r & 7));
+  qword((uint64_t)v);
+}
+
+static void call(const void *fn) {
+  movabs(EAX, fn);
+  byte(0xFF);
+  byte(0xD0);
+}
+
+// Memory operands are addressed off rsi, base loads it unless it
+// already holds a.
+static __thread const void *rsi;
+
+static void base(const void *a) {
+  if (rsi != a) {
+    movabs(ESI, a);
+    rsi = a;
+  }
+}
+
+static void disp(const uint8_t reg, const uint8_t d) {
+  byte(0x40 | ((reg & 7) << 3) | ESI);
+  byte(d);
+}
+
+static void store32(const uint8_t d, const uint8_t r) {
+  rex(r, 0);
+  byte(0x89);
+  disp(r, d);
+}
+
+static void load32(const uint8_t r, const uint8_t d) {
+  rex(r, 0);
+  byte(0x8B);
+  disp(r, d);
+}
+
+static void store16(const uint8_t d, const uint8_t r) {
+  byte(0x66);
+  store32(d, r);
+}
+
+static void store8imm(const uint8_t d, const uint8_t v) {
+  byte(0xC6);
+  disp(0, d);
+  byte(v);
+}
+
+static void store16imm(const uint8_t d, const uint16_t v) {
+  byte(0x66);
+  byte(0xC7);
+  disp(0, d);
+  word(v);
+}
+
+static void store32imm(const uint8_t d, const uint32_t v) {
+  byte(0xC7);
+  disp(0, d);
+  dword(v);
+}
+
+// Guest registers written by translated instructions since they were
+// last stored to m->R.
+static __thread uint8_t dirty;
+
+static void spill() {
+  for (uint8_t i = 0; i < 6; i++) {
+    if (dirty & (1 << i)) {
+      base(m->R);
+      store32(4 * i, hreg[i]);
+    }
+  }
+  dirty = 0;
+}
+
+static void reload() {
+  base(m->R);
+  for (uint8_t i = 0; i < 6; i++) {
+    load32(hreg[i], 4 * i);
+  }
+}
+
+static void prologue() {
+  byte(0x53);                          // push rbx
+  byte(0x55);                          // push rbp
+  for (uint8_t r = R12; r <= R15; r++) {
+    byte(0x41);                        // push r12-r15
+    byte(0x50 | (r & 7));
+  }
+  byte(0x48); byte(0x83); byte(0xEC); byte(0x08);  // sub rsp, 8
+  reload();
+}
+
+static void epilogue(const uint8_t n) {
+  movimm(EAX, n);
+  byte(0x48); byte(0x83); byte(0xC4); byte(0x08);  // add rsp, 8
+  for (uint8_t r = R15; r >= R12; r--) {
+    byte(0x41);
+    byte(0x58 | (r & 7));
+  }
+  byte(0x5D);
+  byte(0x5B);
+  byte(0xC3);
+}
+
+// callout calls fn(&c) with the guest registers in m->R.
+static void callout(void (*fn)(const cpu::cell &), const cpu::cell &c) {
+  spill();
+  movabs(EDI, &c);
+  call((const void *)fn);
+  rsi = NULL;
+}
+
+// The instructions the JIT translates, word sized with mode 0 operands
+// on R0-R5, or an immediate source.
+enum { IMOV, IMOVB, ICMP, IBIT, IBIC, IBIS, IADD, ISUB, IXOR, ICLR, ICOM, IINC, IDEC, INEG, ITST };
+
+struct form {
+  uint16_t mask;
+  uint16_t value;
+  uint8_t kind;
+  uint8_t cc;
+};
+
+static const form forms[] = {
+  { 0170000, 0010000, IMOV, cpu::CCNZ },
+  { 0170000, 0110000, IMOVB, cpu::CCNZ },
+  { 0170000, 0020000, ICMP, cpu::CCCMP },
+  { 0170000, 0030000, IBIT, cpu::CCNZ },
+  { 0170000, 0040000, IBIC, cpu::CCNZ },
+  { 0170000, 0050000, IBIS, cpu::CCNZ },
+  { 0170000, 0060000, IADD, cpu::CCADD },
+  { 0170000, 0160000, ISUB, cpu::CCSUB },
+  { 0177000, 0074000, IXOR, cpu::CCNZ },
+  { 0177700, 0005000, ICLR, cpu::CCTST },
+  { 0177700, 0005100, ICOM, cpu::CCCOM },
+  { 0177700, 0005200, IINC, cpu::CCINC },
+  { 0177700, 0005300, IDEC, cpu::CCDEC },
+  { 0177700, 0005400, INEG, cpu::CCNEG },
+  { 0177700, 0005700, ITST, cpu::CCTST },
+};
+
+static bool immediate(const cpu::decoded &in) {
+  return (in.s == 027) && (in.nimm == 1);
+}
+
+// translatable returns the forms entry for in, or NULL.
+static const form *translatable(const cpu::decoded &in) {
+  if (in.d >= 6) {
+    return NULL;
+  }
+  for (const form &f : forms) {
+    if ((in.instr & f.mask) != f.value) {
+      continue;
+    }
+    if (f.kind == IXOR) {
+      return (in.s & 7) < 6 ? &f : NULL;
+    }
+    if ((f.mask == 0170000) && (in.s >= 6) && !immediate(in)) {
+      return NULL;
+    }
+    return &f;
+  }
+  return NULL;
+}
+
+// translate emits in, cc is the kind of operation m->cc holds before
+// it, or -1 if that is not known.
+static void translate(const cpu::decoded &in, const form &f, const int8_t cc) {
+  if (!(f.cc & cpu::CCTST) && (cc < 0 || (cc & cpu::CCTST))) {
+    // the setcc fold: test byte [rsi+op], CCTST; jz; call keepcarry
+    base(&m->cc);
+    byte(0xF6);
+    disp(0, offsetof(cpu::ccrecord, op));
+    byte(cpu::CCTST);
+    byte(0x74);
+    byte(12);
+    call((const void *)cpu::keepcarry);
+    rsi = NULL;
+  }
+  const uint8_t d = hreg[in.d];
+  if (f.mask == 0170000) {
+    if (immediate(in)) {
+      movimm(ECX, f.kind == IMOVB ? in.imm[0] & 0xFF : in.imm[0]);
+    }
+    else {
+      movzx(ECX, hreg[in.s], f.kind == IMOVB);
+    }
+  }
+  else if (f.kind == IXOR) {
+    movzx(ECX, hreg[in.s & 7]);
+  }
+  if ((f.kind != IMOV) && (f.kind != IMOVB) && (f.kind != ICLR)) {
+    movzx(EDX, d);
+  }
+  uint8_t res = EAX;
+  switch (f.kind) {
+    case IMOV:
+      res = ECX;
+      break;
+    case IMOVB:
+      res = ECX;
+      movsx8(EAX, ECX);
+      mask16(EAX);
+      break;
+    case ICMP:
+      alu(MOV, EAX, ECX);
+      alu(SUB, EAX, EDX);
+      mask16(EAX);
+      break;
+    case IBIT:
+      alu(MOV, EAX, ECX);
+      alu(AND, EAX, EDX);
+      break;
+    case IBIC:
+      alu(MOV, EAX, ECX);
+      group(0xF7, 2, EAX);
+      alu(AND, EAX, EDX);
+      break;
+    case IBIS:
+      alu(MOV, EAX, ECX);
+      alu(OR, EAX, EDX);
+      break;
+    case IADD:
+      alu(MOV, EAX, ECX);
+      alu(ADD, EAX, EDX);
+      mask16(EAX);
+      break;
+    case ISUB:
+      alu(MOV, EAX, EDX);
+      alu(SUB, EAX, ECX);
+      mask16(EAX);
+      break;
+    case IXOR:
+      alu(MOV, EAX, ECX);
+      alu(XOR, EAX, EDX);
+      break;
+    case ICLR:
+      alu(XOR, EAX, EAX);
+      break;
+    case ICOM:
+      alu(MOV, EAX, EDX);
+      group(0x81, 6, EAX);
+      dword(0xFFFF);
+      break;
+    case IINC:
+      alu(MOV, EAX, EDX);
+      group(0x83, 0, EAX);
+      byte(1);
+      mask16(EAX);
+      break;
+    case IDEC:
+      alu(MOV, EAX, EDX);
+      group(0x83, 5, EAX);
+      byte(1);
+      mask16(EAX);
+      break;
+    case INEG:
+      alu(MOV, EAX, EDX);
+      group(0xF7, 3, EAX);
+      mask16(EAX);
+      break;
+    case ITST:
+      res = EDX;
+      break;
+  }
+  base(&m->cc);
+  store8imm(offsetof(cpu::ccrecord, op), f.cc);
+  store8imm(offsetof(cpu::ccrecord, l), f.kind == IMOVB ? 1 : 2);
+  if ((f.kind == ICMP) || (f.kind == IADD) || (f.kind == ISUB)) {
+    store16(offsetof(cpu::ccrecord, src), ECX);
+    store16(offsetof(cpu::ccrecord, dst), EDX);
+  }
+  else {
+    store16imm(offsetof(cpu::ccrecord, src), 0);
+    store16imm(offsetof(cpu::ccrecord, dst), 0);
+  }
+  store16(offsetof(cpu::ccrecord, res), res);
+  if ((f.kind != ICMP) && (f.kind != IBIT) && (f.kind != ITST)) {
+    alu(MOV, d, (f.kind == IMOVB) ? EAX : res);
+    dirty |= 1 << in.d;
+  }
+}
+
+static FILE *openperfmap() {
+  char name[32];
+  snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int)getpid());
+  return fopen(name, "w");
+}
+
+static void writeperfmap(const cpu::block &b, const uint8_t *start) {
+  if (!PERFMAP) {
+    return;
+  }
+  static FILE *perfmap = openperfmap();
+  if (!perfmap) {
+    return;
+  }
+  fprintf(perfmap, "%lx %lx pdp11:%c%06o\n", (unsigned long)start, (unsigned long)(p - start), b.user ? 'u' : 'k', b.vpc);
+  fflush(perfmap);
+}
+
+cpu::native compile(const cpu::block &b) {
+  if (m->jitfailed || full()) {
+    return NULL;
+  }
+  if (!m->jitcode) {
+    void *c = mmap(NULL, CODESIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c == MAP_FAILED) {
+      m->jitfailed = true;
+      return NULL;
+    }
+    m->jitcode = (uint8_t *)c;
+  }
+  uint8_t translated = 0;
+  for (uint8_t i = 0; i < b.n; i++) {
+    if (translatable(b.cells[i].in)) {
+      translated++;
+    }
+  }
+  if (translated == 0) {
+    // every instruction would be a call out, the interpreter is faster.
+    return NULL;
+  }
+
+  uint8_t *start = m->jitcode + m->jitused;
+  p = start;
+  rsi = NULL;
+  dirty = 0;
+  prologue();
+  int8_t cc = -1;
+  for (uint8_t i = 0; i < b.n; i++) {
+    const cpu::cell &c = b.cells[i];
+    const form *f = translatable(c.in);
+    if (f) {
+      if (PRINTSTATE) {
+        callout(cpu::trace, c);
+        cc = -1;
+      }
+      translate(c.in, *f, cc);
+      cc = f->cc;
+      if (i == b.n - 1) {
+        spill();
+        base(&m->R[7]);
+        store32imm(0, c.pc + (immediate(c.in) ? 4 : 2));
+        base(&m->PC);
+        store16imm(0, c.pc);
+      }
+      continue;
+    }
+    callout(cpu::exec, c);
+    reload();
+    cc = -1;
+    if (i < b.n - 1) {
+      // cmp byte [exitblock], 0; je over the epilogue
+      base(&m->exitblock);
+      byte(0x80);
+      disp(7, 0);
+      byte(0);
+      byte(0x74);
+      uint8_t *skip = p++;
+      epilogue(i + 1);
+      *skip = p - skip - 1;
+    }
+  }
+  epilogue(b.n);
+  m->jitused += p - start;
+  writeperfmap(b, start);
+  return (cpu::native)start;
+}
+
+bool full() {
+  return m->jitused + BLOCKCODE > CODESIZE;
+}
+
+void reset() {
+  m->jitused = 0;
+}
+
+void release(machine *mc) {
+  if (mc->jitcode) {
+    munmap(mc->jitcode, CODESIZE);
+  }
+  mc->jitcode = NULL;
+  mc->jitused = 0;
+}
+
+#else
+
+cpu::native compile(const cpu::block &b) {
+  return NULL;
+}
+
+bool full() {
+  return false;
+}
+
+void reset() {
+}
+
+void release(machine *mc) {
+}
+
+#endif
+
+};
+
+#endif
@@ -0,0 +1,22 @@
+// jit compiles the hot blocks of the block interpreter to native code
+// on an x86-64 host, see jit.cpp.
+
+#if !defined(__AVR__)
+
+namespace jit {
+
+// compile returns b compiled to native code, or NULL if it is not worth
+// compiling or the JIT is not available.
+cpu::native compile(const cpu::block &b);
+
+// full reports whether the JIT has run out of room for code, the block
+// interpreter then drops its blocks and calls reset.
+bool full();
+void reset();
+
+// release unmaps mc's code.
+void release(machine *mc);
+
+};
+
+#endif
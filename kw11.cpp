@@ -0,0 +1,28 @@
+#include "hal.h"
+#include "avr11.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+#include "unibus.h"
+#include "kw11.h"
+
+namespace kw11 {
+
+uint16_t read16(uint32_t) {
+  return m->LKS;
+}
+
+void write16(uint32_t, const uint16_t v) {
+  m->LKS = v;
+}
+
+void tick() {
+  m->LKS |= (1 << 7);
+  if (m->LKS & (1 << 6)) {
+    unibus::interrupt(unibus::KW11);
+  }
+  event::schedule(event::CLOCK, TICK);
+}
+
+};
@@ -0,0 +1,12 @@
+// kw11 is the KW11-L line clock. It ticks every TICK instructions, an
+// idle CPU sees the ticks at 60 Hz, TICKUSEC apart.
+namespace kw11 {
+
+enum { TICK = 1 << 14, TICKUSEC = 16667 };
+
+uint16_t read16(uint32_t a);
+void write16(uint32_t a, uint16_t v);
+// tick is called when the CLOCK event is due.
+void tick();
+
+};
@@ -0,0 +1,258 @@
+// machine is one PDP-11/40: the CPU, MMU, interrupt table, line clock,
+// console and RK05, and on the host its memory and translated code.
+// All emulator state lives in a machine, and the code that emulates it
+// reaches it through m, the machine the running thread emulates.
+//
+// The AVR has a single machine at a fixed address, so m is a constant
+// and the state is still addressed directly. The host can emulate one
+// machine per thread, m is then thread local and set by bind.
+//
+// Each unit's state starts on its own cache line, so the CPU's lines
+// are not shared with the devices it polls.
+
+#if defined(__AVR__)
+enum { CACHELINE = 1 };
+#else
+enum { CACHELINE = 64, PAGE = 4096 };
+#endif
+
+// runstats counts what a call of machine::run did.
+struct runstats {
+  uint32_t instructions;  // run
+  uint32_t traps;         // taken, EMT, TRAP, BPT and IOT aside
+  uint32_t interrupts;    // taken
+};
+
+struct machine {
+  // cpu
+  alignas(CACHELINE) int32_t R[8];  // signed integer registers
+  uint16_t PS;        // processor status
+  uint16_t PC;        // address of current instruction
+  uint16_t KSP, USP;  // kernel and user stack pointer
+  uint16_t LKS;
+  bool curuser, prevuser;
+  bool waiting;       // in WAIT
+  uint16_t trapped;   // vector of the pending trap, see cpu::trap
+  cpu::ccrecord cc;
+
+  // imm points at the instruction stream words of the running
+  // instruction that the icache already holds, nimm counts them.
+  // lit is the address of a (PC)+ operand whose value is in litval.
+  const uint16_t *imm;
+  uint8_t nimm;
+  uint32_t lit;
+  uint16_t litval;
+
+  // interrupts waiting to be taken, see cpu::interrupt. irqlevels has
+  // a bit for each priority with one pending. irqvecs[pri - 4] has a
+  // bit for each vector pending at pri, and irqwords[pri - 4] a bit for
+  // each of its words that is not 0.
+  uint8_t irqlevels;
+  uint8_t irqwords[4];
+  uint32_t irqvecs[4][4];
+
+  // events, see event.h.
+  uint32_t now;            // instructions run since power up
+  uint32_t due[event::N];  // when each event is due
+  uint8_t pending;         // a bit for each event that is
+  uint8_t scheduled;       // events scheduled while the CPU ran
+
+  // traps and interrupts taken since power up.
+  uint32_t traps;
+  uint32_t interrupts;
+
+  // mmu
+  // pages has the kernel and user I space pages, then on the 11/70 the
+  // kernel and user D space pages. ubmap is the 11/70's UNIBUS map, see
+  // unibus::dma. Without PDP1170, as on the AVR, pages has only the I
+  // space pages and ubmap is never used.
+  alignas(CACHELINE) mmu::page pages[PDP1170 ? 32 : 16];
+  uint16_t SR0, SR2, SR3;
+  uint32_t ubmap[PDP1170 ? 32 : 1];
+#if !defined(__AVR__)
+  // tlb[w][i] translates pages[i] for reads, or writes if w, see
+  // mmu::decode. Translations that hit or miss it, or fault.
+  mmu::tlbentry tlb[2][32];
+  uint32_t tlbhits, tlbmisses, tlbfaults;
+
+  // RAM's memfd, or -1 when RAM is mapped copy on write, and the address
+  // spaces mapped from it: kernel, user and MMU off, see mmu::spaces.
+  // spaceoff[s][j] is the offset in RAM mapped at page j of space s, or
+  // NOMAP. direct[w][s] has a bit for each page of space s that can be
+  // read, or written if w, straight from the mapping.
+  int memfd;
+  uint8_t *space[3];
+  uint32_t spaceoff[3][8];
+  uint8_t direct[2][3];
+#endif
+
+  // rk11
+  alignas(CACHELINE) uint32_t RKBA, RKDS, RKER, RKCS, RKWC;
+  uint32_t drive, sector, surface, cylinder;
+
+  // cons
+  alignas(CACHELINE) uint16_t TKS, TKB, TPS, TPB;
+
+#if !defined(__AVR__)
+  // block interpreter, see cpu::run.
+  alignas(CACHELINE) bool exitblock;
+  uint32_t mapgen[2];  // counts changes to the kernel and user mapping
+  uint16_t nblocks;
+  uint32_t epoch;      // counts flushes of pool
+  cpu::block *from;
+  uint32_t fromepoch;
+  const void *execop, *lastop, *fuseop;
+  uint32_t fired[cpu::NFUSIONS];
+
+  // jit
+  uint8_t *jitcode;
+  uint32_t jitused;
+  bool jitfailed;
+
+  FILE *rkdata;  // the RK05 image
+
+  // a forked machine's RK05, see hal::diskfork. rkcow holds the sectors
+  // written since the first fork by number, shared with the machines
+  // forked since. rksec points at the sector being transferred, in
+  // rkcow or in rkbuf.
+  uint8_t **rkcow;
+  uint32_t rkpos;
+  uint8_t *rksec;
+  uint8_t rkbuf[512];
+
+  // console input record and replay, see replay.cpp.
+  FILE *replaylog;
+  uint8_t replaymode;   // replay::OFF, RECORD or PLAY
+  uint32_t replayat;    // when the last entry was, or in PLAY the next
+  uint8_t replaykind;   // kind of the next entry in PLAY
+  uint8_t replayc;      // its character
+
+  const char *snappath;  // where SNAPKEY saves a snapshot, see snapshot.h
+
+  // RAM as it was at forkat, the last fork, shared copy on write with
+  // the machines forked then, or -1. See snapshot::fork.
+  int forkfd;
+  uint32_t forkat;
+
+  // ram starts on a page so a snapshot can be mapped over it.
+  alignas(PAGE) uint16_t ram[MEMSIZE >> 1];
+
+  // the icache holds a predecoded instruction for every word of RAM
+  // that has been executed. codeblocks marks the 64 byte blocks of RAM
+  // that hold cached instructions, so writes only have to invalidate
+  // when they hit one.
+  uint8_t codeblocks[MEMSIZE >> 6];
+  cpu::decoded icache[MEMSIZE >> 1];
+
+  cpu::block *blocks[MEMSIZE >> 1];
+  cpu::block pool[cpu::NBLOCKS];
+
+  // profile, see prof.cpp. Instructions run by instruction word and by
+  // mode and physical address, kept only with PROFILE, and traps and
+  // interrupts by vector.
+  uint64_t opcount[PROFILE ? 1 << 16 : 1];
+  uint64_t pccount[2][PROFILE ? MEMSIZE >> 1 : 1];
+  uint64_t trapcount[128];
+  uint64_t irqcount[128];
+
+  // trace, see trace.cpp.
+  uint8_t *tracebuf;  // the ring of NCHUNKS chunks
+  uint32_t tracepos;  // offset in tracebuf of the next record
+  uint32_t traceseq;  // sequence number of the chunk being written
+  bool tracesync;     // the next record starts a chunk
+  uint16_t tracepc;   // address of the instruction after the last
+  uint16_t traceps;   // PS before the last instruction
+  uint32_t traceea;   // the last effective address written
+  uint8_t nstream;    // instruction stream words of the running instruction
+  uint8_t nea;        // effective addresses it has used, up to 2
+  uint32_t ea[2];
+#endif
+
+  // bind makes this the machine the calling thread emulates.
+  void bind();
+
+  // reset powers the machine up, running the bootrom.
+  void reset();
+
+  // run emulates up to budget instructions, see avr11.cpp.
+  runstats run(uint32_t budget);
+
+  // loop emulates the machine, it only returns by halting the host.
+  void loop();
+
+private:
+  void fire();
+  void idle();
+};
+
+#if defined(__AVR__)
+
+extern machine machine0;
+static machine *const m = &machine0;
+
+#else
+
+extern __thread machine *m;
+
+// newmachine returns a machine in its power up state, not yet reset.
+machine *newmachine();
+
+// freemachine releases mc, its RAM, address spaces, code and the disk
+// sectors it alone holds. mc must not be running, nor be the calling
+// thread's machine.
+void freemachine(machine *mc);
+
+#endif
+
+namespace mmu {
+
+// dspace reports whether the 11/70's kernel, or user, data references
+// go to its D space pages.
+static inline bool dspace(const bool user) {
+  return PDP1170 && (m->SR3 & (user ? 1 : 4));
+}
+
+// mapped22 reports whether the 11/70's PARs map 22 bit addresses.
+static inline bool mapped22() {
+  return PDP1170 && (m->SR3 & 020);
+}
+
+};
+
+namespace cpu {
+
+// interruptdue reports whether an interrupt is waiting that the CPU's
+// priority lets in.
+static inline bool interruptdue() {
+  return m->irqlevels >> ((m->PS >> 5) & 7);
+}
+
+// written must be called after every write to RAM so the icache can
+// drop instructions decoded from a.
+static inline void written(const uint32_t a) {
+#if !defined(__AVR__)
+  if (m->codeblocks[a >> 6]) {
+    flushblock(a);
+  }
+#endif
+}
+
+// iowritten must be called after every write to the I/O page, the
+// block interpreter stops after the instruction that did it.
+static inline void iowritten() {
+#if !defined(__AVR__)
+  m->exitblock = true;
+#endif
+}
+
+// remapped must be called when the kernel or user address mapping
+// changes, blocks translated under the old mapping are then dropped.
+static inline void remapped(const bool user) {
+#if !defined(__AVR__)
+  if (++m->mapgen[user] == 0) {
+    m->mapgen[user] = 1;
+  }
+#endif
+}
+
+};
@@ -1,116 +1,348 @@
-#include <Arduino.h>
+#include <string.h>
+#if !defined(__AVR__)
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "hal.h"
 #include "avr11.h"
 #include "cpu.h"
 #include "mmu.h"
+#include "event.h"
+#include "machine.h"
 
 namespace mmu {
 
-struct page {
-    uint16_t par;
-    union {
-     struct {
-      uint8_t low;
-      uint8_t high;
-     } bytes;
-     uint16_t word;
-    } pdr;
-};
+// base returns the physical address pages[i] starts at. Without 22 bit
+// mapping a PAR has 12 bits, the 18 bit addresses it reaches past
+// 0760000 are the I/O page, see reloc.
+static inline uint32_t base(const page &p) {
+  if (mapped22()) {
+    return (uint32_t)p.par << 6;
+  }
+  return (uint32_t)(p.par & 07777) << 6;
+}
+
+// reloc moves 18 bit address aa to the 11/70's I/O page, where it is not
+// the 11/40's.
+static inline uint32_t reloc(const uint32_t aa) {
+  if ((IOPAGE != 0760000) && !mapped22() && (aa >= 0760000)) {
+    return aa - 0760000 + IOPAGE;
+  }
+  return aa;
+}
+
+// top is the end of the RAM base can reach.
+static inline uint32_t top() {
+  return mapped22() ? MEMSIZE : 0760000;
+}
+
+#if !defined(__AVR__)
+
+// Guest RAM is a memfd, and each address space is a 64KB region of host
+// memory whose 8KB pages are mapped from it where the guest's are, so
+// the CPU reaches RAM through a space with a pointer add, see
+// cpu::read16. A page is only mapped when all of it is valid RAM that
+// starts on a host page: its length covers the whole page, and it is
+// not in the I/O page. Other pages, and all of them until the MMU
+// first maps them, are left as PROT_NONE guards and translated by
+// decode, which faults or reaches the I/O page. A page can be
+// written directly once its written bit is set, so decode sets it. On
+// the 11/70 a space has its mode's D pages when SR3 enables them, the
+// CPU reaches its I pages through decode.
+enum { SPACESIZE = 0200000, PAGESIZE = 020000 };
+
+void spaces(machine *mc) {
+  mc->memfd = -1;
+  const uint32_t host = sysconf(_SC_PAGESIZE);
+  if ((MEMSIZE % host) || (PAGESIZE % host) || ((uintptr_t)mc->ram % host)) {
+    return;
+  }
+  const int fd = memfd_create("avr11-ram", 0);
+  if (fd < 0) {
+    return;
+  }
+  void *v = MAP_FAILED;
+  if ((ftruncate(fd, MEMSIZE) != 0) ||
+      (mmap(mc->ram, MEMSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) ||
+      ((v = mmap(NULL, SPACES * SPACESIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED)) {
+    close(fd);
+    return;
+  }
+  for (uint8_t s = 0; s < SPACES; s++) {
+    mc->space[s] = (uint8_t *)v + s * SPACESIZE;
+    for (uint8_t j = 0; j < 8; j++) {
+      mc->spaceoff[s][j] = NOMAP;
+    }
+  }
+  // with the MMU off the first 7 pages are RAM, the last is the I/O page
+  // past its first 4KB.
+  for (uint8_t j = 0; j < 7; j++) {
+    if (mmap(mc->space[OFF] + j * PAGESIZE, PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, j * PAGESIZE) == MAP_FAILED) {
+      close(fd);
+      return;
+    }
+    mc->spaceoff[OFF][j] = j * PAGESIZE;
+  }
+  mc->direct[0][OFF] = 0177;
+  mc->direct[1][OFF] = 0177;
+  mc->memfd = fd;
+}
+
+void dropspaces(machine *mc) {
+  if (mc->memfd >= 0) {
+    close(mc->memfd);
+  }
+  mc->memfd = -1;
+  memset(mc->direct, 0, sizeof(mc->direct));
+  if (mc->space[0]) {
+    munmap(mc->space[0], SPACES * SPACESIZE);
+    memset(mc->space, 0, sizeof(mc->space));
+  }
+}
+
+// mappage maps pages[i], or the page its space has in its place, into
+// the space if it can be, see spaces.
+static void mappage(uint8_t i) {
+  const uint8_t s = (i >> 3) & 1;
+  const uint8_t j = i & 7;
+  i = (dspace(s) ? 16 : 0) + (s << 3) + j;
+  m->direct[0][s] &= ~(1 << j);
+  m->direct[1][s] &= ~(1 << j);
+  if (m->memfd < 0) {
+    return;
+  }
+  const page &p = m->pages[i];
+  const uint32_t off = base(p);
+  const uint8_t len = p.pdr.bytes.high & 0x7f;
+  const bool whole = (p.pdr.bytes.low & 8) ? (len == 0) : (len == 0177);
+  if (!whole || (off % sysconf(_SC_PAGESIZE)) || (off + PAGESIZE > top())) {
+    return;
+  }
+  if (m->spaceoff[s][j] != off) {
+    if (mmap(m->space[s] + j * PAGESIZE, PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m->memfd, off) == MAP_FAILED) {
+      m->spaceoff[s][j] = NOMAP;
+      return;
+    }
+    m->spaceoff[s][j] = off;
+  }
+  if (p.pdr.bytes.low & 2) {
+    m->direct[0][s] |= 1 << j;
+  }
+  if ((p.pdr.bytes.low & 6) == 6 && (p.pdr.bytes.low & (1 << 6))) {
+    m->direct[1][s] |= 1 << j;
+  }
+}
 
-page pages[16];
-uint16_t SR0, SR2;
+void flush() {
+  memset(m->tlb, 0, sizeof(m->tlb));
+  for (uint8_t i = 0; i < 16; i++) {
+    mappage(i);
+  }
+}
 
-uint32_t decode(const uint16_t a, const bool w, const bool user) {
-  if (SR0 & 1) {
+void tlbreport() {
+  xprintf("tlb hits %lu misses %lu faults %lu\r\n", (unsigned long)m->tlbhits, (unsigned long)m->tlbmisses, (unsigned long)m->tlbfaults);
+}
+
+// fill makes the TLB entry for pages[i] from its PAR and PDR. Addresses
+// beyond the page length still miss, decode then faults them. A page
+// that reloc splits between RAM and the I/O page is not filled.
+static void fill(const uint8_t i, const bool w) {
+  const page &p = m->pages[i];
+  const uint16_t start = (i & 7) << 13;
+  const uint8_t len = p.pdr.bytes.high & 0x7f;
+  const uint32_t b = base(p);
+  const uint32_t moved = reloc(b) - b;
+  if (reloc(b + PAGESIZE - 1) - (b + PAGESIZE - 1) != moved) {
+    return;
+  }
+  tlbentry &e = m->tlb[w][i];
+  e.base = b + moved - start;
+  if (p.pdr.bytes.low & 8) {
+    // expands down, blocks len to 0177.
+    e.lo = start + (len << 6);
+    e.span = (0200 - len) << 6;
+  } else {
+    e.lo = start;
+    e.span = (len + 1) << 6;
+  }
+}
+
+#endif
+
+// changed empties the TLB entries for pages[i] and maps its space's page
+// again.
+static inline void changed(const uint8_t i) {
+#if !defined(__AVR__)
+  m->tlb[0][i].span = 0;
+  m->tlb[1][i].span = 0;
+  mappage(i);
+#endif
+}
+
+static inline void tlbfault() {
+#if !defined(__AVR__)
+  if (TLBSTATS) {
+    m->tlbfaults++;
+  }
+#endif
+}
+
+// decode translates a through the TLB. A miss takes the long way round,
+// which faults or fills the entry; a write entry is only filled once the
+// page's written bit is set.
+uint32_t decode(const uint16_t a, const bool w, const bool user, const bool d) {
+  if (m->SR0 & 1) {
     // mmu enabled
-    const uint8_t i = user ? ((a >> 13) + 8) : (a >> 13);
-    if (w && !pages[i].pdr.bytes.low & 6) {
-      SR0 = (1 << 13) | 1;
-      SR0 |= (a >> 12) & ~1;
+    uint8_t i = user ? ((a >> 13) + 8) : (a >> 13);
+    if (d && dspace(user)) {
+      i += 16;
+    }
+#if !defined(__AVR__)
+    const tlbentry &e = m->tlb[w][i];
+    if ((uint16_t)(a - e.lo) < e.span) {
+      if (TLBSTATS) {
+        m->tlbhits++;
+      }
+      return e.base + a;
+    }
+    if (TLBSTATS) {
+      m->tlbmisses++;
+    }
+#endif
+    if (w && ((m->pages[i].pdr.bytes.low & 6) != 6)) {
+      m->SR0 = (1 << 13) | 1;
+      m->SR0 |= (a >> 12) & ~1;
       if (user) {
-        SR0 |= (1 << 5) | (1 << 6);
+        m->SR0 |= (1 << 5) | (1 << 6);
       }
-      SR2 = cpu::PC;
+      m->SR2 = m->PC;
 
-      Serial.print(F("mmu::decode write to read-only page ")); Serial.println(a, OCT);
-      longjmp(trapbuf, INTFAULT);
+      xprintf("mmu::decode write to read-only page %06o\r\n", a);
+      tlbfault();
+      cpu::trap(INTFAULT);
+      return 0;
     }
-    if (!pages[i].pdr.bytes.low & 2) {
-      SR0 = (1 << 15) | 1;
-      SR0 |= (a >> 12) & ~1;
+    if (!(m->pages[i].pdr.bytes.low & 2)) {
+      m->SR0 = (1 << 15) | 1;
+      m->SR0 |= (a >> 12) & ~1;
       if (user) {
-        SR0 |= (1 << 5) | (1 << 6);
+        m->SR0 |= (1 << 5) | (1 << 6);
       }
-      SR2 = cpu::PC;
-      Serial.print(F("mmu::decode read from no-access page ")); Serial.println(a, OCT);
-      longjmp(trapbuf, INTFAULT);
+      m->SR2 = m->PC;
+      xprintf("mmu::decode read from no-access page %06o\r\n", a);
+      tlbfault();
+      cpu::trap(INTFAULT);
+      return 0;
     }
     const uint8_t block = (a >> 6) & 0177;
     const uint8_t disp = a & 077;
     // if ((p.ed() && (block < p.len())) || (!p.ed() && (block > p.len()))) {
-    if ((pages[i].pdr.bytes.low & 8) ? (block < (pages[i].pdr.bytes.high & 0x7f)) : (block > (pages[i].pdr.bytes.high & 0x7f))) {
-      SR0 = (1 << 14) | 1;
-      SR0 |= (a >> 12) & ~1;
+    if ((m->pages[i].pdr.bytes.low & 8) ? (block < (m->pages[i].pdr.bytes.high & 0x7f)) : (block > (m->pages[i].pdr.bytes.high & 0x7f))) {
+      m->SR0 = (1 << 14) | 1;
+      m->SR0 |= (a >> 12) & ~1;
       if (user) {
-        SR0 |= (1 << 5) | (1 << 6);
+        m->SR0 |= (1 << 5) | (1 << 6);
       }
-      SR2 = cpu::PC;
-      printf("page length exceeded, address %06o (block %03o) is beyond length %03o\r\n", a, block, (pages[i].pdr.bytes.high & 0x7f));
-      longjmp(trapbuf, INTFAULT);
+      m->SR2 = m->PC;
+      xprintf("page length exceeded, address %06o (block %03o) is beyond length %03o\r\n", a, block, (m->pages[i].pdr.bytes.high & 0x7f));
+      tlbfault();
+      cpu::trap(INTFAULT);
+      return 0;
     }
-    if (w) {
-      pages[i].pdr.bytes.low |= 1 << 6;
+    if (w && !(m->pages[i].pdr.bytes.low & (1 << 6))) {
+      m->pages[i].pdr.bytes.low |= 1 << 6;
+#if !defined(__AVR__)
+      mappage(i);
+#endif
     }
     // danger, this can be cast to a uint16_t if you aren't careful
-    uint32_t aa = pages[i].par & 07777;
-    aa += block;
-    aa <<= 6;
+    uint32_t aa = base(m->pages[i]);
+    aa += (uint32_t)block << 6;
     aa += disp;
+    aa = reloc(aa);
     if (DEBUG_MMU) {
-      Serial.print("decode: slow "); Serial.print(a, OCT); Serial.print(" -> "); Serial.println(aa, OCT);
+      xprintf("decode: slow %06o -> %06lo\r\n", a, (unsigned long)aa);
     }
+#if !defined(__AVR__)
+    fill(i, w);
+#endif
     return aa;
   }
   // mmu disabled, fast path
-  return a > 0167777 ? ((uint32_t)a) + 0600000 : a;
+  return a > 0167777 ? ((uint32_t)a) + IOPAGE - 0160000 : a;
 }
 
-uint16_t read16(const uint32_t a) {
-  if ((a >= 0772300) && (a < 0772320)) {
-    return pages[((a & 017) >> 1)].pdr.word;
+// reg returns the index in pages of the PDR, or the PAR if par is set,
+// at a, or -1. The 11/70's D space registers follow the I space ones.
+static int8_t reg(const uint32_t a, bool &par) {
+  uint8_t i;
+  if ((a & 0777700) == 0772300) {
+    i = 0;
+  } else if ((a & 0777700) == 0777600) {
+    i = 8;
+  } else {
+    return -1;
   }
-  if ((a >= 0772340) && (a < 0772360)) {
-    return pages[((a & 017) >> 1)].par;
+  if (a & 020) {
+    if (!PDP1170) {
+      return -1;
+    }
+    i += 16;
   }
-  if ((a >= 0777600) && (a < 0777620)) {
-    return pages[((a & 017) >> 1) + 8].pdr.word;
+  par = a & 040;
+  return i + ((a & 017) >> 1);
+}
+
+uint16_t read16(const uint32_t a) {
+  bool par;
+  const int8_t i = reg(a, par);
+  if (i >= 0) {
+    return par ? m->pages[i].par : m->pages[i].pdr.word;
   }
-  if ((a >= 0777640) && (a < 0777660)) {
-    return pages[((a & 017) >> 1) + 8].par;
+  switch (a) {
+    case 0777572:
+      return m->SR0;
+    case 0777576:
+      return m->SR2;
+    case 0772516:
+      return m->SR3;
   }
-  Serial.print(F("mmu::read16 invalid read from ")); Serial.println(a, OCT);
-  longjmp(trapbuf, INTBUS);
+  xprintf("mmu::read16 invalid read from %06lo\r\n", (unsigned long)a);
+  cpu::trap(INTBUS);
+  return 0;
 }
 
 void write16(const uint32_t a, const uint16_t v) {
-  uint8_t i = ((a & 017) >> 1);
-  if ((a >= 0772300) && (a < 0772320)) {
-    pages[i].pdr.word = v;
-    return;
-  }
-  if ((a >= 0772340) && (a < 0772360)) {
-    pages[i].par = v;
-    return;
-  }
-  if ((a >= 0777600) && (a < 0777620)) {
-    pages[i + 8].pdr.word = v;
+  bool par;
+  const int8_t i = reg(a, par);
+  if (i >= 0) {
+    if (par) {
+      m->pages[i].par = v;
+    } else {
+      m->pages[i].pdr.word = v;
+    }
+    changed(i);
+    cpu::remapped(i & 8);
     return;
   }
-  if ((a >= 0777640) && (a < 0777660)) {
-    pages[i + 8].par = v;
-    return;
+  switch (a) {
+    case 0777572:
+      m->SR0 = v;
+      cpu::remapped(false);
+      cpu::remapped(true);
+      return;
+    case 0772516:
+      m->SR3 = v & 067;
+#if !defined(__AVR__)
+      flush();
+#endif
+      cpu::remapped(false);
+      cpu::remapped(true);
+      return;
   }
-  Serial.print(F("mmu::write16 write to invalid address ")); Serial.println(a, OCT);
-  longjmp(trapbuf, INTBUS);
+  xprintf("mmu::write16 write to invalid address %06lo\r\n", (unsigned long)a);
+  cpu::trap(INTBUS);
 }
 
 };
@@ -1,9 +1,51 @@
 namespace mmu {
   
-    extern uint16_t SR0;
-    extern uint16_t SR2;
+    // page is a page address register and its descriptor.
+    struct page {
+        uint16_t par;
+        union {
+         struct {
+          uint8_t low;
+          uint8_t high;
+         } bytes;
+         uint16_t word;
+        } pdr;
+    };
 
-    uint32_t decode(uint16_t a, bool w, bool user);
+#if !defined(__AVR__)
+    // tlbentry is the translation of a page in one mode for reads or
+    // for writes: a virtual address a with a - lo below span is at
+    // physical address base + a. An entry with span 0 is empty.
+    struct tlbentry {
+        uint32_t base;
+        uint16_t lo;
+        uint16_t span;
+    };
+
+    // flush empties the TLB and remaps the address spaces, it must be
+    // called when pages changes other than through write16.
+    void flush();
+
+    // spaces backs mc's RAM with a memfd and maps its address spaces
+    // from it, see mmu.cpp. A machine without them, as on a host whose
+    // pages do not divide the PDP-11's, translates every access.
+    void spaces(machine *mc);
+
+    // dropspaces stops mc using its address spaces and unmaps them, its
+    // RAM is about to be mapped copy on write from elsewhere or mc is
+    // being freed.
+    void dropspaces(machine *mc);
+
+    // NOMAP marks a page of an address space with nothing mapped.
+    enum { SPACES = 3, OFF = 2, NOMAP = 0xFFFFFFFF };
+
+    // tlbreport prints the TLB counters, see TLBSTATS.
+    void tlbreport();
+#endif
+
+    // decode translates virtual address a of the kernel or user space
+    // to a physical address, for a write if w and a data reference if d.
+    uint32_t decode(uint16_t a, bool w, bool user, bool d);
     uint16_t read16(uint32_t a);
     void write16(uint32_t a, uint16_t v);
 
@@ -0,0 +1,85 @@
+// INSTRUCTIONS describes the PDP-11/40 instruction set, one
+// X(mask, value, mnemonic, operand flags, byte form, handler)
+// per instruction. An instruction word decodes to the first entry where
+// (instr & mask) == value, so order matters.
+//
+// cpu.cpp builds its dispatch table from this list, disasm.cpp builds
+// disamtable from it. Handlers are the static functions in cpu.cpp.
+// Instructions with a destination operand are listed as T(...) instead
+// of X(...): their handler is a template specialized on the operand width,
+// taken from bit 15 when the instruction has a byte form, and on the
+// source and destination addressing modes.
+
+// operand flags
+enum {
+  DD = 1 << 1, // destination operand, mode and register in bits 0-5
+  S = 1 << 2,  // source operand, mode and register in bits 6-11
+  RR = 1 << 3, // register in bits 6-8, or bits 0-2 without DD or O
+  O = 1 << 4,  // branch offset
+  NN = 1 << 5, // number in the low bits
+  CT = 1 << 6  // may transfer control, ends a translated block
+};
+
+#define INSTRUCTIONS(X, T) \
+  T(0070000, 0010000, "MOV",   S | DD,        true,  MOV) \
+  T(0070000, 0020000, "CMP",   S | DD,        true,  CMP) \
+  T(0070000, 0030000, "BIT",   S | DD,        true,  BIT) \
+  T(0070000, 0040000, "BIC",   S | DD,        true,  BIC) \
+  T(0070000, 0050000, "BIS",   S | DD,        true,  BIS) \
+  T(0170000, 0060000, "ADD",   S | DD,        false, ADD) \
+  T(0170000, 0160000, "SUB",   S | DD,        false, SUB) \
+  T(0177000, 0004000, "JSR",   RR | DD | CT,  false, JSR) \
+  T(0177000, 0070000, "MUL",   RR | DD,       false, MUL) \
+  T(0177000, 0071000, "DIV",   RR | DD,       false, DIV) \
+  T(0177000, 0072000, "ASH",   RR | DD,       false, ASH) \
+  T(0177000, 0073000, "ASHC",  RR | DD,       false, ASHC) \
+  T(0177000, 0074000, "XOR",   RR | DD,       false, XOR) \
+  X(0177000, 0077000, "SOB",   RR | O | CT,   false, SOB) \
+  T(0077700, 0005000, "CLR",   DD,            true,  CLR) \
+  T(0077700, 0005100, "COM",   DD,            true,  COM) \
+  T(0077700, 0005200, "INC",   DD,            true,  INC) \
+  T(0077700, 0005300, "DEC",   DD,            true,  _DEC) \
+  T(0077700, 0005400, "NEG",   DD,            true,  NEG) \
+  T(0077700, 0005500, "ADC",   DD,            true,  _ADC) \
+  T(0077700, 0005600, "SBC",   DD,            true,  SBC) \
+  T(0077700, 0005700, "TST",   DD,            true,  TST) \
+  T(0077700, 0006000, "ROR",   DD,            true,  ROR) \
+  T(0077700, 0006100, "ROL",   DD,            true,  ROL) \
+  T(0077700, 0006200, "ASR",   DD,            true,  ASR) \
+  T(0077700, 0006300, "ASL",   DD,            true,  ASL) \
+  T(0077700, 0006700, "SXT",   DD,            false, SXT) \
+  T(0177700, 0000100, "JMP",   DD | CT,       false, JMP) \
+  T(0177700, 0000300, "SWAB",  DD,            false, SWAB) \
+  X(0177700, 0006400, "MARK",  NN | CT,       false, MARK) \
+  T(0177700, 0006500, "MFPI",  DD,            false, MFPI) \
+  T(0177700, 0006600, "MTPI",  DD,            false, MTPI) \
+  T(0177700, 0106500, "MFPD",  DD,            false, MFPD) \
+  T(0177700, 0106600, "MTPD",  DD,            false, MTPD) \
+  X(0177770, 0000200, "RTS",   RR | CT,       false, RTS) \
+  X(0177400, 0000400, "BR",    O | CT,        false, BR) \
+  X(0177400, 0001000, "BNE",   O | CT,        false, BXX) \
+  X(0177400, 0001400, "BEQ",   O | CT,        false, BXX) \
+  X(0177400, 0002000, "BGE",   O | CT,        false, BXX) \
+  X(0177400, 0002400, "BLT",   O | CT,        false, BXX) \
+  X(0177400, 0003000, "BGT",   O | CT,        false, BXX) \
+  X(0177400, 0003400, "BLE",   O | CT,        false, BXX) \
+  X(0177400, 0100000, "BPL",   O | CT,        false, BXX) \
+  X(0177400, 0100400, "BMI",   O | CT,        false, BXX) \
+  X(0177400, 0101000, "BHI",   O | CT,        false, BXX) \
+  X(0177400, 0101400, "BLOS",  O | CT,        false, BXX) \
+  X(0177400, 0102000, "BVC",   O | CT,        false, BXX) \
+  X(0177400, 0102400, "BVS",   O | CT,        false, BXX) \
+  X(0177400, 0103000, "BCC",   O | CT,        false, BXX) \
+  X(0177400, 0103400, "BCS",   O | CT,        false, BXX) \
+  X(0177400, 0104000, "EMT",   NN | CT,       false, EMTX) \
+  X(0177400, 0104400, "TRAP",  NN | CT,       false, EMTX) \
+  X(0177777, 0000003, "BPT",   CT,            false, EMTX) \
+  X(0177777, 0000004, "IOT",   CT,            false, EMTX) \
+  X(0177760, 0000240, "CCC",   0,             false, CCOP) \
+  X(0177760, 0000260, "SCC",   0,             false, CCOP) \
+  X(0177777, 0000000, "HALT",  CT,            false, HALT) \
+  X(0177777, 0000001, "WAIT",  CT,            false, WAIT) \
+  X(0177777, 0000002, "RTI",   CT,            false, RTT) \
+  X(0177777, 0000006, "RTT",   CT,            false, RTT) \
+  X(0177777, 0000005, "RESET", CT,            false, RESET) \
+  X(0177777, 0170011, "SETD",  0,             false, SETD)
@@ -0,0 +1,199 @@
+#if !defined(__AVR__)
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hal.h"
+#include "avr11.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+#include "opcodes.h"
+#include "prof.h"
+
+namespace prof {
+
+// The profile counts every instruction word run and every physical
+// address an instruction was run from, in each mode, see count. The
+// report sums the words by the INSTRUCTIONS entry they decode to, that
+// entry's handler and its class of operands.
+
+struct entry {
+  uint16_t mask;
+  uint16_t value;
+  const char *name;
+  const char *handler;
+  uint8_t flags;
+};
+
+static const entry entries[] = {
+#define X(mask, value, name, flags, b, fn) { mask, value, name, #fn, (flags) & ~CT },
+  INSTRUCTIONS(X, X)
+#undef X
+};
+
+enum { NENTRIES = sizeof(entries) / sizeof(entries[0]) };
+
+static const struct {
+  uint8_t flags;
+  const char *name;
+} classes[] = {
+  { S | DD, "double operand" },
+  { RR | DD, "register and operand" },
+  { DD, "single operand" },
+  { O, "branch" },
+  { RR | O, "branch" },
+  { NN, "immediate" },
+  { RR, "register" },
+  { 0, "no operand" },
+};
+
+enum { NCLASSES = sizeof(classes) / sizeof(classes[0]) };
+
+// A row is one line of a section of the report.
+struct row {
+  const char *name;
+  uint64_t n;
+  uint32_t key;
+};
+
+static int bycount(const void *a, const void *b) {
+  const row *x = (const row *)a;
+  const row *y = (const row *)b;
+  if (x->n != y->n) {
+    return x->n < y->n ? 1 : -1;
+  }
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// add adds n to the row named name, rows with the same name are summed.
+static void add(row *rows, uint32_t &nrows, const char *name, const uint64_t n) {
+  for (uint32_t i = 0; i < nrows; i++) {
+    if (strcmp(rows[i].name, name) == 0) {
+      rows[i].n += n;
+      return;
+    }
+  }
+  rows[nrows].name = name;
+  rows[nrows].n = n;
+  rows[nrows].key = nrows;
+  nrows++;
+}
+
+static const entry *lookup(const uint16_t instr) {
+  for (uint8_t i = 0; i < NENTRIES; i++) {
+    if ((instr & entries[i].mask) == entries[i].value) {
+      return &entries[i];
+    }
+  }
+  return NULL;
+}
+
+static const char *classof(const entry *e) {
+  for (uint8_t i = 0; i < NCLASSES; i++) {
+    if (e->flags == classes[i].flags) {
+      return classes[i].name;
+    }
+  }
+  return "other";
+}
+
+enum { TOP = 20 };  // rows of each section printed
+
+static void section(FILE *f, const char *kind, row *rows, const uint32_t nrows, const uint64_t total) {
+  qsort(rows, nrows, sizeof(row), bycount);
+  xprintf("%s\r\n", kind);
+  for (uint32_t i = 0; i < nrows; i++) {
+    if (i < TOP) {
+      xprintf("  %-22s %12llu %5.1f%%\r\n", rows[i].name, (unsigned long long)rows[i].n, 100.0 * rows[i].n / total);
+    }
+    if (f) {
+      fprintf(f, "%s\t%s\t%llu\n", kind, rows[i].name, (unsigned long long)rows[i].n);
+    }
+  }
+}
+
+static void vectors(FILE *f, const char *kind, const uint64_t *counts) {
+  xprintf("%s\r\n", kind);
+  for (uint8_t i = 0; i < 128; i++) {
+    if (counts[i]) {
+      xprintf("  %03o %12llu\r\n", i << 1, (unsigned long long)counts[i]);
+      if (f) {
+        fprintf(f, "%s\t%03o\t%llu\n", kind, i << 1, (unsigned long long)counts[i]);
+      }
+    }
+  }
+}
+
+static FILE *openprofile() {
+  char name[32];
+  snprintf(name, sizeof(name), "/tmp/avr11-%d.prof", (int)getpid());
+  return fopen(name, "w");
+}
+
+void report() {
+  // without PROFILE the machine has no counts to report.
+  if (!PROFILE) {
+    return;
+  }
+  FILE *f = openprofile();
+  static row rows[3][NENTRIES + 1];
+  uint32_t nrows[3] = { 0, 0, 0 };
+  uint64_t total = 0;
+  for (uint32_t instr = 0; instr < 0x10000; instr++) {
+    const uint64_t n = m->opcount[instr];
+    if (!n) {
+      continue;
+    }
+    total += n;
+    const entry *e = lookup(instr);
+    add(rows[0], nrows[0], e ? classof(e) : "invalid", n);
+    add(rows[1], nrows[1], e ? e->handler : "INVAL", n);
+    add(rows[2], nrows[2], e ? e->name : "???", n);
+  }
+  xprintf("profile of %llu instructions\r\n", (unsigned long long)total);
+  if (!total) {
+    total = 1;
+  }
+  section(f, "class", rows[0], nrows[0], total);
+  section(f, "handler", rows[1], nrows[1], total);
+  section(f, "op", rows[2], nrows[2], total);
+
+  // the hottest instructions, labelled with what is at their address now.
+  row *pcs = (row *)malloc(sizeof(row) * 2 * (MEMSIZE >> 1));
+  uint32_t npcs = 0;
+  for (uint8_t user = 0; user < 2; user++) {
+    for (uint32_t i = 0; i < MEMSIZE >> 1; i++) {
+      if (pcs && m->pccount[user][i]) {
+        pcs[npcs].name = user ? "u" : "k";
+        pcs[npcs].n = m->pccount[user][i];
+        pcs[npcs].key = i << 1;
+        npcs++;
+      }
+    }
+  }
+  qsort(pcs, npcs, sizeof(row), bycount);
+  xprintf("pc\r\n");
+  for (uint32_t i = 0; i < npcs; i++) {
+    if (i < TOP) {
+      xprintf("  %s %06lo %12llu %5.1f%%  ", pcs[i].name, (unsigned long)pcs[i].key, (unsigned long long)pcs[i].n, 100.0 * pcs[i].n / total);
+      disasm(pcs[i].key);
+      xprintf("\r\n");
+    }
+    if (f) {
+      fprintf(f, "pc\t%s\t%06lo\t%llu\n", pcs[i].name, (unsigned long)pcs[i].key, (unsigned long long)pcs[i].n);
+    }
+  }
+  free(pcs);
+
+  vectors(f, "trap", m->trapcount);
+  vectors(f, "interrupt", m->irqcount);
+  if (f) {
+    fclose(f);
+  }
+}
+
+};
+
+#endif
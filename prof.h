@@ -0,0 +1,25 @@
+// prof reports where the guest's instructions went when PROFILE is set,
+// see prof.cpp.
+
+#if !defined(__AVR__)
+
+namespace prof {
+
+// Typing PROFKEY, ^T, at the console prints the report so far.
+enum { PROFKEY = 024 };
+
+// count records the instruction instr run from physical address pa.
+static inline void count(const uint32_t pa, const uint16_t instr) {
+  m->opcount[instr]++;
+  if (pa < MEMSIZE) {
+    m->pccount[m->curuser][pa >> 1]++;
+  }
+}
+
+// report prints the counts sorted, most first, and writes them all to
+// /tmp/avr11-<pid>.prof one per line for other programs to read.
+void report();
+
+};
+
+#endif
@@ -0,0 +1,151 @@
+#if !defined(__AVR__)
+
+#include <string.h>
+#include "hal.h"
+#include "avr11.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+#include "cons.h"
+#include "replay.h"
+
+namespace replay {
+
+// The log starts with MAGIC, then has an entry for each input: the
+// instructions run since the entry before as a varint, 7 bits at a
+// time low first with the top bit set on all but the last, and its
+// kind. A BYTE entry is followed by the character. TIME entries keep
+// the gaps between entries under 2^31 instructions so the 32 bit
+// instruction count can be used.
+static const char MAGIC[8] = { 'a', 'v', 'r', '1', '1', 'i', 'n', '1' };
+
+enum { NONE, BYTE, WAKE, TIME };
+
+enum { MAXGAP = 1UL << 30 };
+
+static void put(const uint8_t kind, const uint8_t c) {
+  uint32_t d = m->now - m->replayat;
+  m->replayat = m->now;
+  while (d >= 0x80) {
+    putc((d & 0x7F) | 0x80, m->replaylog);
+    d >>= 7;
+  }
+  putc(d, m->replaylog);
+  putc(kind, m->replaylog);
+  if (kind == BYTE) {
+    putc(c, m->replaylog);
+  }
+  fflush(m->replaylog);
+}
+
+// next reads the next entry to play back. At the end of the log the
+// console goes back to the host.
+static void next() {
+  uint32_t d = 0;
+  uint8_t shift = 0;
+  int b;
+  do {
+    b = getc(m->replaylog);
+    if (b == EOF) {
+      break;
+    }
+    d |= (uint32_t)(b & 0x7F) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  const int kind = (b == EOF) ? EOF : getc(m->replaylog);
+  const int c = (kind == BYTE) ? getc(m->replaylog) : 0;
+  if ((kind == EOF) || (c == EOF)) {
+    fclose(m->replaylog);
+    m->replaylog = NULL;
+    m->replaymode = OFF;
+    m->replaykind = NONE;
+    return;
+  }
+  m->replayat += d;
+  m->replaykind = kind;
+  m->replayc = c;
+}
+
+bool start(const char *path, const bool record) {
+  m->replaylog = fopen(path, record ? "wb" : "rb");
+  if (!m->replaylog) {
+    return false;
+  }
+  m->replayat = m->now;
+  if (record) {
+    m->replaymode = RECORD;
+    return fwrite(MAGIC, sizeof(MAGIC), 1, m->replaylog) == 1;
+  }
+  char magic[sizeof(MAGIC)];
+  if ((fread(magic, sizeof(magic), 1, m->replaylog) != 1) || memcmp(magic, MAGIC, sizeof(MAGIC))) {
+    return false;
+  }
+  m->replaymode = PLAY;
+  next();
+  return true;
+}
+
+// diverged stops a play back that has missed an entry, the guest did
+// not run as it did when the log was recorded.
+static void diverged() {
+  xprintf("replay: diverged at %lu\r\n", (unsigned long)m->now);
+  panic();
+}
+
+int16_t input() {
+  if (m->replaymode == PLAY) {
+    if ((int32_t)(m->now - m->replayat) > 0) {
+      diverged();
+    }
+    // a WAKE is for wake, the CPU is about to idle.
+    if ((m->now != m->replayat) || (m->replaykind == WAKE)) {
+      return -1;
+    }
+    const uint8_t kind = m->replaykind;
+    const uint8_t c = m->replayc;
+    next();
+    return kind == BYTE ? c : -1;
+  }
+  if (!hal::charavailable()) {
+    if ((m->replaymode == RECORD) && (m->now - m->replayat >= MAXGAP)) {
+      put(TIME, 0);
+    }
+    return -1;
+  }
+  const uint8_t c = hal::readchar();
+  // keys for the host are not the guest's input, and are not recorded.
+  if (cons::hostkey(c)) {
+    return -1;
+  }
+  if (m->replaymode == RECORD) {
+    put(BYTE, c);
+  }
+  return c;
+}
+
+bool playing() {
+  return m->replaymode == PLAY;
+}
+
+uint32_t wake(const uint32_t left) {
+  if (m->replaykind != WAKE) {
+    return left;
+  }
+  const uint32_t d = m->replayat - m->now;
+  if (d >= left) {
+    return left;
+  }
+  next();
+  return d;
+}
+
+void woke() {
+  if (m->replaymode == RECORD) {
+    put(WAKE, 0);
+  }
+}
+
+};
+
+#endif
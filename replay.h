@@ -0,0 +1,49 @@
+// replay makes a run repeatable. Line clock ticks and disk and console
+// output completions are already timed in instructions, see event.h,
+// so the only inputs that depend on the host are the characters typed
+// at the console and when an idle CPU is woken by one. replay records
+// both in a log, keyed to the instruction count, and plays them back in
+// place of the host's console, see replay.cpp.
+
+namespace replay {
+
+enum { OFF, RECORD, PLAY };
+
+#if defined(__AVR__)
+
+static inline int16_t input() {
+  return hal::charavailable() ? hal::readchar() : -1;
+}
+
+static inline bool playing() {
+  return false;
+}
+
+static inline uint32_t wake(const uint32_t left) {
+  return left;
+}
+
+static inline void woke() {
+}
+
+#else
+
+// start opens the log at path, to record to when record is set or to
+// play back from. It must be called before the machine first runs.
+bool start(const char *path, bool record);
+
+// input returns the character typed at the console, or -1 if there is
+// none.
+int16_t input();
+
+// playing reports whether the log is being played back. An idle CPU
+// then does not wait for the host: wake returns the number of
+// instructions, up to left, until the recorded wake up. woke records
+// that an idle CPU was woken early by the host.
+bool playing();
+uint32_t wake(uint32_t left);
+void woke();
+
+#endif
+
+};
@@ -1,57 +1,76 @@
-#include <stdint.h>
-#include <Arduino.h>
-#include <SdFat.h>
+#include "hal.h"
 #include "avr11.h"
 #include "unibus.h"
 #include "rk05.h"
 #include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
 
 namespace rk11 {
 
-uint32_t RKBA, RKDS, RKER, RKCS, RKWC;
-uint32_t drive, sector, surface, cylinder;
-
-SdFile rkdata;
-
 uint16_t read16(uint32_t a) {
   switch (a) {
     case 0777400:
-      return RKDS;
+      return m->RKDS;
     case 0777402:
-      return RKER;
+      return m->RKER;
     case 0777404:
-      return RKCS | (RKBA & 0x30000) >> 12;
+      return m->RKCS | (m->RKBA & 0x30000) >> 12;
     case 0777406:
-      return RKWC;
+      return m->RKWC;
     case 0777410:
-      return RKBA & 0xFFFF;
+      return m->RKBA & 0xFFFF;
     case 0777412:
-      return (sector) | (surface << 4) | (cylinder << 5) | (drive << 13);
+      return (m->sector) | (m->surface << 4) | (m->cylinder << 5) | (m->drive << 13);
     default:
-      Serial.println(F("rk11::read16 invalid read"));
+      xprintf("rk11::read16 invalid read\r\n");
       panic();
   }
 }
 
 static void rknotready() {
-  digitalWrite(13, 1);
-  RKDS &= ~(1 << 6);
-  RKCS &= ~(1 << 7);
+  hal::diskled(true);
+  m->RKDS &= ~(1 << 6);
+  m->RKCS &= ~(1 << 7);
 }
 
 static void rkready() {
-  RKDS |= 1 << 6;
-  RKCS |= 1 << 7;
-  digitalWrite(13, 0);
+  m->RKDS |= 1 << 6;
+  m->RKCS |= 1 << 7;
+  hal::diskled(false);
 }
 
 void rkerror(uint16_t e) {
 }
 
+// The transfer runs while the CPU does not, so a bus error does not trap
+// the CPU. The transfer stops with a nonexistent memory error, as it
+// does when the host fails to write the disk.
+static void nxm() {
+  m->trapped = 0;
+  m->RKER |= RKNXM;
+  m->RKCS |= (1 << 15) | (1 << 14);
+  rkready();
+  if (m->RKCS & (1 << 6)) {
+    unibus::interrupt(unibus::RK11);
+  }
+}
+
+// An RK05 turns once every 40ms, RKSECTOR instructions for each of its
+// 12 sectors. A transfer is done half a turn after it starts, plus the
+// time to pass over the sectors it reads or writes.
+enum { RKSECTOR = 3277 };
+
+static uint32_t latency() {
+  const uint32_t words = 0x10000 - m->RKWC;
+  return (6 + ((words + 255) >> 8)) * (uint32_t)RKSECTOR;
+}
+
 static void step() {
   again:
   bool w;
-  switch ((RKCS & 017) >> 1) {
+  switch ((m->RKCS & 017) >> 1) {
     case 0:
       return;
     case 1:
@@ -61,74 +80,80 @@ static void step() {
       w = false;
       break;
     default:
-      Serial.println(F("unimplemented RK05 operation")); //  %#o", ((r.RKCS & 017) >> 1)))
+      xprintf("unimplemented RK05 operation\r\n"); //  %#o", ((r.RKCS & 017) >> 1)))
       panic();
   }
 
   if (DEBUG_RK05) {
-    Serial.print("rkstep: RKBA: ");
-    Serial.print(RKBA, DEC);
-    Serial.print(" RKWC: ");
-    Serial.print(RKWC, DEC);
-    Serial.print(" cylinder: ");
-    Serial.print(cylinder, DEC);
-    Serial.print(" sector: ");
-    Serial.print(sector, DEC);
-    Serial.print(" write: ");
-    Serial.println(w ? "true" : "false");
+    xprintf("rkstep: RKBA: %lu RKWC: %lu cylinder: %lu sector: %lu write: %s\r\n",
+            (unsigned long)m->RKBA, (unsigned long)m->RKWC, (unsigned long)m->cylinder, (unsigned long)m->sector, w ? "true" : "false");
   }
 
-  if (drive != 0) {
+  if (m->drive != 0) {
     rkerror(RKNXD);
   }
-  if (cylinder > 0312) {
+  if (m->cylinder > 0312) {
     rkerror(RKNXC);
   }
-  if (sector > 013) {
+  if (m->sector > 013) {
     rkerror(RKNXS);
   }
 
-  int32_t pos = (cylinder * 24 + surface * 12 + sector) * 512;
-  if (!rkdata.seekSet(pos)) {
-    Serial.println(F("rkstep: failed to seek"));
+  int32_t pos = (m->cylinder * 24 + m->surface * 12 + m->sector) * 512;
+  if (!hal::diskseek(pos)) {
+    xprintf("rkstep: failed to seek\r\n");
     panic();
   }
 
   uint16_t i;
   uint16_t val;
-  for (i = 0; i < 256 && RKWC != 0; i++) {
+  for (i = 0; i < 256 && m->RKWC != 0; i++) {
     if (w) {
-      val = unibus::read16(RKBA);
-      rkdata.write(val & 0xFF);
-      rkdata.write((val >> 8) & 0xFF);
+      val = unibus::read16(unibus::dma(m->RKBA));
+      if (m->trapped) {
+        nxm();
+        return;
+      }
+      if (!hal::diskwrite(val & 0xFF) || !hal::diskwrite((val >> 8) & 0xFF)) {
+        nxm();
+        return;
+      }
     } else {
-      unibus::write16(RKBA, rkdata.read() | (rkdata.read() << 8));
+      unibus::write16(unibus::dma(m->RKBA), hal::diskread() | (hal::diskread() << 8));
+      if (m->trapped) {
+        nxm();
+        return;
+      }
     }
-    RKBA += 2;
-    RKWC = (RKWC + 1) & 0xFFFF;
+    m->RKBA += 2;
+    m->RKWC = (m->RKWC + 1) & 0xFFFF;
   }
-  sector++;
-  if (sector > 013) {
-    sector = 0;
-    surface++;
-    if (surface > 1) {
-      surface = 0;
-      cylinder++;
-      if (cylinder > 0312) {
+  m->sector++;
+  if (m->sector > 013) {
+    m->sector = 0;
+    m->surface++;
+    if (m->surface > 1) {
+      m->surface = 0;
+      m->cylinder++;
+      if (m->cylinder > 0312) {
         rkerror(RKOVR);
       }
     }
   }
-  if (RKWC == 0) {
+  if (m->RKWC == 0) {
     rkready();
-    if (RKCS & (1 << 6)) {
-      cpu::interrupt(INTRK, 5);
+    if (m->RKCS & (1 << 6)) {
+      unibus::interrupt(unibus::RK11);
     }
   } else {
     goto again;
   }
 }
 
+void done() {
+  step();
+}
+
 void write16(uint32_t a, uint16_t v) {
   //printf("rkwrite: %06o\n",a);
   switch (a) {
@@ -137,50 +162,51 @@ void write16(uint32_t a, uint16_t v) {
     case 0777402:
       break;
     case 0777404:
-      RKBA = (RKBA & 0xFFFF) | ((v & 060) << 12);
+      m->RKBA = (m->RKBA & 0xFFFF) | ((v & 060) << 12);
       v &= 017517; // writable bits
-      RKCS &= ~017517;
-      RKCS |= v & ~1; // don't set GO bit
+      m->RKCS &= ~017517;
+      m->RKCS |= v & ~1; // don't set GO bit
       if (v & 1) {
-        switch ((RKCS & 017) >> 1) {
+        switch ((m->RKCS & 017) >> 1) {
           case 0:
             reset();
             break;
           case 1:
           case 2:
             rknotready();
-            step();
+            event::schedule(event::RK, latency());
             break;
           default:
-            Serial.println(F("unimplemented RK05 operation")); // %#o", ((r.RKCS & 017) >> 1)))
+            xprintf("unimplemented RK05 operation\r\n"); // %#o", ((r.RKCS & 017) >> 1)))
             panic();
         }
       }
       break;
     case 0777406:
-      RKWC = v;
+      m->RKWC = v;
       break;
     case 0777410:
-      RKBA = (RKBA & 0x30000) | (v);
+      m->RKBA = (m->RKBA & 0x30000) | (v);
       break;
     case 0777412:
-      drive = v >> 13;
-      cylinder = (v >> 5) & 0377;
-      surface = (v >> 4) & 1;
-      sector = v & 15;
+      m->drive = v >> 13;
+      m->cylinder = (v >> 5) & 0377;
+      m->surface = (v >> 4) & 1;
+      m->sector = v & 15;
       break;
     default:
-      Serial.println(F("rkwrite16: invalid write"));
+      xprintf("rkwrite16: invalid write\r\n");
       panic();
   }
 }
 
 void reset() {
-  RKDS = (1 << 11) | (1 << 7) | (1 << 6);
-  RKER = 0;
-  RKCS = 1 << 7;
-  RKWC = 0;
-  RKBA = 0;
+  event::cancel(event::RK);
+  m->RKDS = (1 << 11) | (1 << 7) | (1 << 6);
+  m->RKER = 0;
+  m->RKCS = 1 << 7;
+  m->RKWC = 0;
+  m->RKBA = 0;
 }
 
 };
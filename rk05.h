@@ -1,14 +1,15 @@
 namespace rk11 {
 
-  extern SdFile rkdata;
-  
 void reset();
 void write16(uint32_t a, uint16_t v);
 uint16_t read16(uint32_t a);
+// done is called when the RK event is due, it makes the transfer.
+void done();
 };
 
 enum {
   RKOVR = (1 << 14),
+  RKNXM = (1 << 10),
   RKNXD = (1 << 7),
   RKNXC = (1 << 6),
   RKNXS = (1 << 5)
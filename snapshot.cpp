@@ -0,0 +1,219 @@
+#if !defined(__AVR__)
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hal.h"
+#include "avr11.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+#include "snapshot.h"
+
+namespace snapshot {
+
+// A snapshot is a header, the fields below one after the other in host
+// byte order, and RAM at ramoff, a multiple of the host's page size. VERSION must change whenever the fields do.
+static const char MAGIC[8] = { 'a', 'v', 'r', '1', '1', 's', 'n', 'p' };
+
+enum { VERSION = 3 };
+
+struct header {
+  char magic[8];
+  uint32_t version;
+  uint32_t memsize;    // MEMSIZE
+  uint32_t statesize;  // the fields
+  uint32_t ramoff;
+};
+
+struct field {
+  uint16_t off, size;
+};
+
+#define FIELD(f) { offsetof(machine, f), sizeof(((machine *)0)->f) }
+
+// fields is the machine state that outlives an instruction. The icache,
+// the translated blocks and the counters of the profiler and the trace
+// are not saved, they start again empty.
+static const field fields[] = {
+  // cpu
+  FIELD(R), FIELD(PS), FIELD(PC), FIELD(KSP), FIELD(USP), FIELD(LKS),
+  FIELD(curuser), FIELD(prevuser), FIELD(waiting), FIELD(trapped), FIELD(cc),
+  FIELD(irqlevels), FIELD(irqwords), FIELD(irqvecs),
+  FIELD(now), FIELD(due), FIELD(pending), FIELD(traps), FIELD(interrupts),
+  // mmu
+  FIELD(pages), FIELD(SR0), FIELD(SR2), FIELD(SR3), FIELD(ubmap),
+  // rk11
+  FIELD(RKBA), FIELD(RKDS), FIELD(RKER), FIELD(RKCS), FIELD(RKWC),
+  FIELD(drive), FIELD(sector), FIELD(surface), FIELD(cylinder),
+  // cons
+  FIELD(TKS), FIELD(TKB), FIELD(TPS), FIELD(TPB),
+};
+
+enum { NFIELDS = sizeof(fields) / sizeof(fields[0]) };
+
+static uint32_t statesize() {
+  uint32_t n = 0;
+  for (uint8_t i = 0; i < NFIELDS; i++) {
+    n += fields[i].size;
+  }
+  return n;
+}
+
+static uint32_t pagesize() {
+  return sysconf(_SC_PAGESIZE);
+}
+
+// mappable reports whether RAM can be mapped from offset off of a file.
+static bool mappable(const uint32_t off) {
+  const uint32_t page = pagesize();
+  return ((uintptr_t)m->ram % page == 0) && (off % page == 0) && (MEMSIZE % page == 0);
+}
+
+void arm(const char *path) {
+  m->snappath = path;
+}
+
+// put writes the snapshot to f.
+static bool put(FILE *f) {
+  const uint32_t page = pagesize();
+  header h;
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.version = VERSION;
+  h.memsize = MEMSIZE;
+  h.statesize = statesize();
+  h.ramoff = (sizeof(h) + h.statesize + page - 1) / page * page;
+  if (fwrite(&h, sizeof(h), 1, f) != 1) {
+    return false;
+  }
+  for (uint8_t i = 0; i < NFIELDS; i++) {
+    if (fwrite((uint8_t *)m + fields[i].off, fields[i].size, 1, f) != 1) {
+      return false;
+    }
+  }
+  return (fseek(f, h.ramoff, SEEK_SET) == 0) && (fwrite(m->ram, MEMSIZE, 1, f) == 1);
+}
+
+// save writes path.new and renames it over path, so a save that fails
+// leaves the old snapshot whole.
+bool save() {
+  if (!m->snappath) {
+    return false;
+  }
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.new", m->snappath);
+  FILE *f = fopen(tmp, "wb");
+  bool ok = f && put(f);
+  if (f) {
+    ok = (fclose(f) == 0) && ok;
+  }
+  ok = ok && (rename(tmp, m->snappath) == 0);
+  if (!ok) {
+    unlink(tmp);
+  }
+  xprintf("snapshot: %s %s at %lu\r\n", ok ? "saved" : "saving failed,", m->snappath, (unsigned long)m->now);
+  return ok;
+}
+
+// get reads the snapshot in fd of st.st_size bytes. RAM is read in
+// whole, into the machine's memfd when it has one, as a private mapping
+// of the file could not back its address spaces, see mmu::spaces.
+static bool get(const int fd, const struct stat &st) {
+  header h;
+  if ((pread(fd, &h, sizeof(h), 0) != sizeof(h)) || memcmp(h.magic, MAGIC, sizeof(MAGIC))) {
+    return false;
+  }
+  if ((h.version != VERSION) || (h.memsize != MEMSIZE) || (h.statesize != statesize())) {
+    return false;
+  }
+  if ((h.ramoff < sizeof(h) + h.statesize) || ((uint64_t)st.st_size < (uint64_t)h.ramoff + MEMSIZE)) {
+    return false;
+  }
+  uint8_t *const state = (uint8_t *)malloc(h.statesize);
+  if (pread(fd, state, h.statesize, sizeof(h)) != h.statesize) {
+    free(state);
+    return false;
+  }
+  const uint8_t *p = state;
+  for (uint8_t i = 0; i < NFIELDS; i++) {
+    memcpy((uint8_t *)m + fields[i].off, p, fields[i].size);
+    p += fields[i].size;
+  }
+  free(state);
+  mmu::flush();
+  return pread(fd, m->ram, MEMSIZE, h.ramoff) == MEMSIZE;
+}
+
+bool load(const char *path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  const bool ok = (fstat(fd, &st) == 0) && get(fd, st);
+  close(fd);
+  return ok;
+}
+
+// share copies RAM to a new forkfd, unless the machine has not run since
+// the last fork. A machine whose RAM is not its own memfd then maps it
+// from there too, so its later writes are its own.
+static bool share() {
+  if ((m->forkfd >= 0) && (m->forkat == m->now)) {
+    return true;
+  }
+  const int fd = memfd_create("avr11-ram", 0);
+  if (fd < 0) {
+    return false;
+  }
+  if ((ftruncate(fd, MEMSIZE) != 0) || (pwrite(fd, m->ram, MEMSIZE, 0) != MEMSIZE) ||
+      ((m->memfd < 0) && (mmap(m->ram, MEMSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED))) {
+    close(fd);
+    return false;
+  }
+  if (m->forkfd >= 0) {
+    close(m->forkfd);
+  }
+  m->forkfd = fd;
+  m->forkat = m->now;
+  return true;
+}
+
+machine *fork() {
+  machine *c = newmachine();
+  if (!c) {
+    return NULL;
+  }
+  for (uint8_t i = 0; i < NFIELDS; i++) {
+    memcpy((uint8_t *)c + fields[i].off, (uint8_t *)m + fields[i].off, fields[i].size);
+  }
+  if (mappable(0) && share()) {
+    // RAM mapped copy on write cannot be mapped again into the address
+    // spaces, the child translates every access.
+    mmu::dropspaces(c);
+    if (mmap(c->ram, MEMSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, m->forkfd, 0) == MAP_FAILED) {
+      freemachine(c);
+      return NULL;
+    }
+  } else {
+    memcpy(c->ram, m->ram, MEMSIZE);
+  }
+  if (!hal::diskfork(c)) {
+    freemachine(c);
+    return NULL;
+  }
+  machine *const parent = m;
+  c->bind();
+  mmu::flush();
+  parent->bind();
+  return c;
+}
+
+};
+
+#endif
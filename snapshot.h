@@ -0,0 +1,38 @@
+// snapshot saves a machine's state, RAM included, to a file and
+// restores it, so a system booted once can be resumed in place of
+// booting it again, see snapshot.cpp. The RK05 image is not part of a
+// snapshot, it must be as it was when the snapshot was saved. fork
+// makes the same copy in memory, a running machine can be forked into
+// many that share its RAM and disk.
+
+#if !defined(__AVR__)
+
+namespace snapshot {
+
+// Typing SNAPKEY, ^], at the console saves a snapshot to the path given
+// to arm.
+enum { SNAPKEY = 035 };
+
+// arm makes SNAPKEY save the machine to path.
+void arm(const char *path);
+
+// save saves the machine to the path given to arm, if any, and reports
+// whether it did. It must be called between instructions.
+bool save();
+
+// load restores the machine from the snapshot at path. It must be
+// called before the machine first runs. RAM is read in whole, the file
+// is not used once load returns.
+bool load(const char *path);
+
+// fork returns a new machine in the state of the calling thread's,
+// sharing its RAM and disk copy on write, or NULL. It must be called
+// between instructions. Each machine then pays only for the pages of
+// RAM and the sectors of disk it writes, see hal::diskfork. A child
+// runs on whichever thread calls its run, and is released with
+// freemachine once it is done.
+machine *fork();
+
+};
+
+#endif
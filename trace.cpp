@@ -0,0 +1,263 @@
+#if !defined(__AVR__)
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hal.h"
+#include "avr11.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "event.h"
+#include "machine.h"
+#include "trace.h"
+
+namespace trace {
+
+// A record is a flags byte, followed by
+//   the PC, if FPC is set
+//   PS before the instruction ran, if FPS is set
+//   the instruction word
+//   its stream words, flags & 3 of them
+//   its effective addresses, (flags >> 2) & 3 of them
+// with words little endian. The PC is left out when it is the address
+// after the instruction before, PS when it has not changed. Each
+// effective address is written as the difference from the one before,
+// zigzag encoded in 7 bit groups, low first, with the top bit set on all
+// but the last.
+//
+// A chunk starts with its 32 bit sequence number, 0 if it has never been
+// written, and its records end at an END byte or at the end of the chunk.
+enum {
+  FPC = 1 << 4,
+  FPS = 1 << 5,
+  END = 0xFF,
+  // a difference of physical addresses zigzag encodes to one bit more
+  // than an address, 19 or 23 of them, in 7 bit groups.
+  PABITS = PDP1170 ? 22 : 18,
+  EAMAX = (PABITS + 1 + 6) / 7,
+  RECORDMAX = 1 + 2 + 2 + 2 + 2 * 2 + 2 * EAMAX,
+  RINGSIZE = NCHUNKS * CHUNK
+};
+
+static uint8_t *put16(uint8_t *p, const uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static uint8_t *putea(uint8_t *p, const uint32_t ea) {
+  const int32_t d = ea - m->traceea;
+  uint32_t z = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+  m->traceea = ea;
+  while (z >= 0x80) {
+    *p++ = (z & 0x7F) | 0x80;
+    z >>= 7;
+  }
+  *p++ = z;
+  return p;
+}
+
+// openring maps the ring, shared with /tmp/avr11-<pid>.trace when
+// TRACEFILE is set so it outlives the emulator.
+static uint8_t *openring() {
+  int fd = -1;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (TRACEFILE) {
+    char name[32];
+    snprintf(name, sizeof(name), "/tmp/avr11-%d.trace", (int)getpid());
+    fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if ((fd < 0) || (ftruncate(fd, RINGSIZE) != 0)) {
+      return NULL;
+    }
+    flags = MAP_SHARED;
+  }
+  void *p = mmap(NULL, RINGSIZE, PROT_READ | PROT_WRITE, flags, fd, 0);
+  if (fd >= 0) {
+    close(fd);
+  }
+  return p == MAP_FAILED ? NULL : (uint8_t *)p;
+}
+
+// newchunk moves on to the next chunk of the ring.
+static void newchunk() {
+  if (m->tracepos % CHUNK) {
+    m->tracepos = (m->tracepos / CHUNK + 1) * CHUNK % RINGSIZE;
+  }
+  uint8_t *p = m->tracebuf + m->tracepos;
+  m->traceseq++;
+  p = put16(p, m->traceseq);
+  p = put16(p, m->traceseq >> 16);
+  *p = END;
+  m->tracepos += 4;
+  m->tracesync = true;
+}
+
+void record(const uint16_t ps, const uint32_t pa, const cpu::decoded &in) {
+  if (!m->tracebuf) {
+    m->tracebuf = openring();
+    if (!m->tracebuf) {
+      xprintf("trace: mapping the ring failed\r\n");
+      panic();
+    }
+  }
+  if ((m->tracepos % CHUNK == 0) || (m->tracepos % CHUNK + RECORDMAX + 1 > CHUNK)) {
+    newchunk();
+  }
+  uint8_t *const start = m->tracebuf + m->tracepos;
+  uint8_t *p = start + 1;
+  uint8_t flags = m->nstream | (m->nea << 2);
+  if (m->tracesync || (m->PC != m->tracepc)) {
+    flags |= FPC;
+    p = put16(p, m->PC);
+  }
+  if (m->tracesync || (ps != m->traceps)) {
+    flags |= FPS;
+    p = put16(p, ps);
+  }
+  if (m->tracesync) {
+    m->traceea = 0;
+    m->tracesync = false;
+  }
+  p = put16(p, in.instr);
+  // the stream words are in the icache, unless they were in the next
+  // 64 byte block of RAM.
+  for (uint8_t i = 0; i < m->nstream; i++) {
+    const uint32_t a = pa + 2 * (i + 1);
+    uint16_t w = 0;
+    if (in.nimm == m->nstream) {
+      w = in.imm[i];
+    } else if (a < MEMSIZE) {
+      w = hal::read16(a);
+    }
+    p = put16(p, w);
+  }
+  for (uint8_t i = 0; i < m->nea; i++) {
+    p = putea(p, m->ea[i]);
+  }
+  *start = flags;
+  *p = END;
+  m->tracepos = p - m->tracebuf;
+  m->tracepc = m->PC + 2 + 2 * m->nstream;
+  m->traceps = ps;
+}
+
+// The decoder disassembles each record from its own words.
+static uint16_t words[3];
+static uint16_t wordpc;
+
+static uint16_t word(const uint32_t a) {
+  const uint16_t i = (uint16_t)(a - wordpc) >> 1;
+  return i < 3 ? words[i] : 0;
+}
+
+// get16 and getea read a word and an address delta at p into v, and
+// report whether they did without running past end.
+static bool get16(const uint8_t *&p, const uint8_t *const end, uint16_t &v) {
+  if (end - p < 2) {
+    return false;
+  }
+  v = p[0] | (p[1] << 8);
+  p += 2;
+  return true;
+}
+
+static bool getea(const uint8_t *&p, const uint8_t *const end, uint32_t &v) {
+  uint32_t z = 0;
+  uint8_t shift = 0;
+  uint8_t b;
+  do {
+    if ((p >= end) || (shift > 28)) {
+      return false;
+    }
+    b = *p++;
+    z |= (uint32_t)(b & 0x7F) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  v = (z >> 1) ^ -(z & 1);
+  return true;
+}
+
+static uint32_t seqof(const uint8_t *chunk) {
+  return chunk[0] | (chunk[1] << 8) | (chunk[2] << 16) | ((uint32_t)chunk[3] << 24);
+}
+
+static const uint8_t *ring;
+
+static int byseq(const void *a, const void *b) {
+  const uint32_t x = seqof(ring + *(const uint32_t *)a * CHUNK);
+  const uint32_t y = seqof(ring + *(const uint32_t *)b * CHUNK);
+  return x < y ? -1 : x > y;
+}
+
+int decode(const char *path) {
+  const int fd = open(path, O_RDONLY);
+  struct stat st;
+  if ((fd < 0) || (fstat(fd, &st) != 0) || (st.st_size % CHUNK) || !st.st_size) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    return 1;
+  }
+  void *mp = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mp == MAP_FAILED) {
+    fprintf(stderr, "%s: mapping failed\n", path);
+    return 1;
+  }
+  ring = (const uint8_t *)mp;
+
+  const uint32_t nchunks = st.st_size / CHUNK;
+  uint32_t *order = (uint32_t *)malloc(nchunks * sizeof(uint32_t));
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < nchunks; i++) {
+    if (seqof(ring + i * CHUNK)) {
+      order[n++] = i;
+    }
+  }
+  qsort(order, n, sizeof(uint32_t), byseq);
+
+  for (uint32_t c = 0; c < n; c++) {
+    const uint8_t *p = ring + order[c] * CHUNK + 4;
+    const uint8_t *const end = ring + order[c] * CHUNK + CHUNK;
+    uint16_t pc = 0, ps = 0;
+    uint32_t ea = 0;
+    while ((p < end) && (*p != END)) {
+      // a record is read whole before it is printed, one that runs past
+      // the chunk, or has more stream words than an instruction can,
+      // ends it.
+      const uint8_t flags = *p++;
+      const uint8_t nstream = flags & 3;
+      const uint8_t nea = (flags >> 2) & 3;
+      uint32_t eas[3];
+      bool ok = (nstream < 3) && (!(flags & FPC) || get16(p, end, pc)) && (!(flags & FPS) || get16(p, end, ps));
+      for (uint8_t i = 0; ok && (i <= nstream); i++) {
+        ok = get16(p, end, words[i]);
+      }
+      for (uint8_t i = 0; ok && (i < nea); i++) {
+        ok = getea(p, end, eas[i]);
+      }
+      if (!ok) {
+        fprintf(stderr, "%s: chunk %lu is corrupt\n", path, (unsigned long)order[c]);
+        break;
+      }
+      wordpc = pc;
+      printf("%c %06o %06o %06o  ", (ps >> 14) ? 'u' : 'k', pc, ps, words[0]);
+      disasm(pc, word);
+      for (uint8_t i = 0; i < nea; i++) {
+        ea += eas[i];
+        printf("%s%06lo", i ? " " : "\t[", (unsigned long)ea);
+        if (i == nea - 1) {
+          putchar(']');
+        }
+      }
+      putchar('\n');
+      pc += 2 + 2 * nstream;
+    }
+  }
+  free(order);
+  return 0;
+}
+
+};
+
+#endif
@@ -0,0 +1,47 @@
+// trace records every instruction the CPU runs when TRACE is set, in a
+// ring of compact binary records that can be decoded later, see
+// trace.cpp. Unlike printstate it costs a few bytes of memory per
+// instruction rather than a line of output.
+
+namespace trace {
+
+// ea records that the running instruction accessed virtual address a at
+// physical address pa. Reads of its own instruction stream are not
+// recorded, nor is the write after a read of the same address, and
+// only the first two are kept.
+static inline void ea(const uint16_t a, const uint32_t pa) {
+#if !defined(__AVR__)
+  if (!TRACE || (m->nea >= 2) || ((uint16_t)(a - m->PC - 2) < 2 * m->nstream)) {
+    return;
+  }
+  if (m->nea && (m->ea[m->nea - 1] == pa)) {
+    return;
+  }
+  m->ea[m->nea++] = pa;
+#endif
+}
+
+#if !defined(__AVR__)
+
+// The ring is NCHUNKS chunks of CHUNK bytes. Records do not span
+// chunks, and the first record of a chunk is written in full, so each
+// chunk decodes on its own once the ring has wrapped.
+enum { CHUNK = 4096, NCHUNKS = 256 };
+
+// begin starts the record of an instruction with n stream words,
+// record finishes it once the instruction has run. ps is PS before it
+// ran and pa its physical address.
+static inline void begin(const uint8_t n) {
+  m->nstream = n;
+  m->nea = 0;
+}
+
+void record(uint16_t ps, uint32_t pa, const cpu::decoded &in);
+
+// decode prints the trace in the file at path, oldest first, and returns
+// the exit status for main.
+int decode(const char *path);
+
+#endif
+
+};
@@ -1,149 +1,210 @@
-#include <SdFat.h>
+#include "hal.h"
 #include "avr11.h"
 #include "cpu.h"
 #include "cons.h"
 #include "mmu.h"
+#include "event.h"
+#include "machine.h"
 #include "unibus.h"
+#include "kw11.h"
 #include "rk05.h"
-#include "xmem.h"
 
 namespace unibus {
 
-// memory as words
-int *intptr = reinterpret_cast<int *>(0x2200);
-// memory as bytes
-char *charptr = reinterpret_cast<char *>(0x2200);
+// The 11/70's UNIBUS map has 31 registers, each a low and a high word,
+// that relocate the 8KB pages of the 18 bit UNIBUS address space below
+// the I/O page to 22 bit physical addresses.
+static uint16_t ubmapread(const uint32_t a) {
+  const uint32_t r = m->ubmap[(a - 0770200) >> 2];
+  return (a & 2) ? (r >> 16) & 077 : r & 0177776;
+}
+
+static void ubmapwrite(const uint32_t a, const uint16_t v) {
+  uint32_t &r = m->ubmap[(a - 0770200) >> 2];
+  if (a & 2) {
+    r = (r & 0177776) | ((uint32_t)(v & 077) << 16);
+  } else {
+    r = (r & 017600000) | (v & 0177776);
+  }
+}
+
+uint32_t dma(const uint32_t a) {
+  if (a >= 0760000) {
+    return io(a);
+  }
+  if (PDP1170 && (m->SR3 & 040)) {
+    return m->ubmap[a >> 13] + (a & 017777);
+  }
+  return a;
+}
+
+static constexpr device devices[] ROM = {
+#define DEVICE(id, first, last, read16, write16, read8, write8, reset, vector, priority, event, tick) \
+  { first, last, read16, write16, read8, write8, reset, vector, priority, event, tick },
+  DEVICES(DEVICE)
+#undef DEVICE
+};
+
+// The I/O page is dispatched through iotab, which has an entry for each
+// of its 4096 words: the device whose register is there, or NODEV. It
+// is built from devices when compiled, so a register access costs one
+// lookup. evtab has the device each event belongs to.
+enum { NODEV = NDEVICES, IOWORDS = 020000 >> 1 };
+
+struct iotable {
+  uint8_t dev[IOWORDS];
+  uint8_t evdev[event::N];
+};
+
+static constexpr iotable makeiotab() {
+  iotable t = {};
+  for (uint16_t i = 0; i < IOWORDS; i++) {
+    t.dev[i] = NODEV;
+  }
+  for (uint8_t d = 0; d < NDEVICES; d++) {
+    if (!devices[d].read16) {
+      continue;
+    }
+    for (uint32_t a = devices[d].first; a < devices[d].last; a += 2) {
+      t.dev[(a - 0760000) >> 1] = d;
+    }
+    if (devices[d].event != event::N) {
+      t.evdev[devices[d].event] = d;
+    }
+  }
+  return t;
+}
+
+static constexpr iotable iotab ROM = makeiotab();
+
+// disjoint reports whether each device is in the I/O page and no two
+// answer at the same address.
+static constexpr bool disjoint() {
+  for (uint8_t d = 0; d < NDEVICES; d++) {
+    if ((devices[d].first < 0760000) || (devices[d].last > 0777777) || (devices[d].first > devices[d].last)) {
+      return false;
+    }
+    for (uint8_t e = 0; e < d; e++) {
+      if ((devices[d].first <= devices[e].last) && (devices[e].first <= devices[d].last)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static_assert(disjoint(), "DEVICES entries overlap or are outside the I/O page");
+
+// lookup returns the device at UNIBUS address a, NODEV past the I/O
+// page.
+static inline uint8_t lookup(const uint32_t a) {
+  const uint32_t w = (a - 0760000) >> 1;
+  if (w >= IOWORDS) {
+    return NODEV;
+  }
+  return romread(&iotab.dev[w]);
+}
+
+void reset() {
+  for (uint8_t d = 0; d < NDEVICES; d++) {
+    void (*const fn)() = romread(&devices[d].reset);
+    if (fn) {
+      fn();
+    }
+  }
+}
+
+void interrupt(const uint8_t dev) {
+  cpu::interrupt(romread(&devices[dev].vector), romread(&devices[dev].priority));
+}
+
+void tick(const uint8_t ev) {
+  romread(&devices[romread(&iotab.evdev[ev])].tick)();
+}
 
 uint16_t read8(const uint32_t a) {
+  if (a >= MEMSIZE) {
+    const uint32_t u = a - (IOPAGE - 0760000);
+    const uint8_t d = lookup(u);
+    if (d != NODEV) {
+      uint16_t (*const fn)(uint32_t) = romread(&devices[d].read8);
+      if (fn) {
+        return fn(u);
+      }
+    }
+  }
   if (a & 1) {
     return read16(a & ~1) >> 8;
   }
   return read16(a & ~1) & 0xFF;
 }
 
-static uint8_t bank(const uint32_t a) {
-  // This shift costs 1 Khz of simulated performance,
-  // at least 4 usec / instruction.
-  // return a >> 15;
-  char * aa = (char *)&a;
-  return ((aa[2] & 3)<<1) | (((aa)[1] & (1<<7))>>7);
-}
-
 void write8(const uint32_t a, const uint16_t v) {
-  if (a < 0760000) {
-    xmem::setMemoryBank(bank(a), false);
-    charptr[(a & 0x7fff)] = v & 0xff;
+  if (a < MEMSIZE) {
+    hal::write8(a, v & 0xff);
+    cpu::written(a);
+    return;
+  }
+  const uint32_t u = a - (IOPAGE - 0760000);
+  const uint8_t d = lookup(u);
+  if (d != NODEV) {
+    void (*const fn)(uint32_t, uint16_t) = romread(&devices[d].write8);
+    if (fn) {
+      cpu::iowritten();
+      fn(u, v);
+      return;
+    }
+  }
+  const uint16_t w = read16(a);
+  if (m->trapped) {
     return;
   }
   if (a & 1) {
-    write16(a&~1, (read16(a) & 0xFF) | (v & 0xFF) << 8);
+    write16(a&~1, (w & 0xFF) | (v & 0xFF) << 8);
   } else {
-    write16(a&~1, (read16(a) & 0xFF00) | (v & 0xFF));
+    write16(a&~1, (w & 0xFF00) | (v & 0xFF));
   }
 }
 
 void write16(uint32_t a, uint16_t v) {
   if (a % 1) {
-  Serial.print(F("unibus: write16 to odd address ")); Serial.println(a, OCT);
-  longjmp(trapbuf, INTBUS);
-  }
-  if (a < 0760000) {
-    xmem::setMemoryBank(bank(a), false);
-    intptr[(a & 0x7fff) >> 1] = v;
-    return;
-  }
-  switch (a) {
-    case 0777776:
-      switch (v >> 14) {
-        case 0:
-          cpu::switchmode(false);
-          break;
-        case 3:
-          cpu::switchmode(true);
-          break;
-        default:
-          Serial.println(F("invalid mode"));
-          panic();
-      }
-      switch ((v >> 12) & 3) {
-        case 0:
-          cpu::prevuser = false;
-          break;
-        case 3:
-          cpu::prevuser = true;
-          break;
-        default:
-          Serial.println(F("invalid mode"));
-          panic();
-      }
-      cpu::PS = v;
-      return;
-    case 0777546:
-      cpu::LKS = v;
-      return;
-    case 0777572:
-      mmu::SR0 = v;
-      return;
-  }
-  if ((a & 0777770) == 0777560) {
-    cons::write16(a, v);
-    return;
+  xprintf("unibus: write16 to odd address %06lo\r\n", (unsigned long)a);
+  cpu::trap(INTBUS);
+  return;
   }
-  if ((a & 0777700) == 0777400) {
-    rk11::write16(a, v);
+  if (a < MEMSIZE) {
+    hal::write16(a, v);
+    cpu::written(a);
     return;
   }
-  if (((a & 0777600) == 0772200) || ((a & 0777600) == 0777600)) {
-    mmu::write16(a, v);
+  a -= IOPAGE - 0760000;
+  cpu::iowritten();
+  const uint8_t d = lookup(a);
+  if (d != NODEV) {
+    romread(&devices[d].write16)(a, v);
     return;
   }
-  Serial.print(F("unibus: write to invalid address ")); Serial.println(a, OCT);
-  longjmp(trapbuf, INTBUS);
+  xprintf("unibus: write to invalid address %06lo\r\n", (unsigned long)a);
+  cpu::trap(INTBUS);
 }
 
 uint16_t read16(uint32_t a) {
   if (a & 1) {
-    Serial.print(F("unibus: read16 from odd address ")); Serial.println(a, OCT);
-    longjmp(trapbuf, INTBUS);
-  }
-  if (a < 0760000 ) {
-    xmem::setMemoryBank(bank(a), false);
-    return intptr[(a & 0x7fff) >> 1];
-  }
-  if (a == 0777546) {
-    return cpu::LKS;
-  }
-
-  if (a == 0777570) {
-    return 0173030;
-  }
-
-  if (a == 0777572) {
-    return mmu::SR0;
-  }
-
-  if (a == 0777576) {
-    return mmu::SR2;
-  }
-
-  if (a == 0777776) {
-    return cpu::PS;
-  }
-
-  if ((a & 0777770) == 0777560) {
-    return cons::read16(a);
+    xprintf("unibus: read16 from odd address %06lo\r\n", (unsigned long)a);
+    cpu::trap(INTBUS);
+    return 0;
   }
-
-  if ((a & 0777760) == 0777400) {
-    return rk11::read16(a);
+  if (a < MEMSIZE) {
+    return hal::read16(a);
   }
-
-  if (((a & 0777600) == 0772200) || ((a & 0777600) == 0777600)) {
-    return mmu::read16(a);
+  a -= IOPAGE - 0760000;
+  const uint8_t d = lookup(a);
+  if (d != NODEV) {
+    return romread(&devices[d].read16)(a);
   }
-
-  Serial.print(F("unibus: read from invalid address ")); Serial.println(a, OCT);
-  longjmp(trapbuf, INTBUS);
+  xprintf("unibus: read from invalid address %06lo\r\n", (unsigned long)a);
+  cpu::trap(INTBUS);
+  return 0;
 }
 
 };
@@ -10,5 +10,70 @@ namespace unibus {
     uint16_t read16(uint32_t addr);
     void write8(uint32_t a, uint16_t v);
     void write16(uint32_t a, uint16_t v);
+
+    // io returns the physical address of the I/O page register at
+    // UNIBUS address a. The devices are addressed by the latter.
+    static inline uint32_t io(const uint32_t a) {
+        return a - 0760000 + IOPAGE;
+    }
+
+    // dma returns the physical address a device's transfer to UNIBUS
+    // address a reaches, through the 11/70's UNIBUS map when SR3
+    // enables it.
+    uint32_t dma(uint32_t a);
+
+    // A device is a controller on the bus: the I/O page registers it
+    // answers at, from UNIBUS address first to last, the handlers that
+    // read and write them, what RESET does to it, the interrupt it
+    // posts and the handler called when its event is due. Handlers are
+    // given the UNIBUS address, and trap on a register they do not
+    // decode, see cpu::trap.
+    //
+    // read8 and write8 may be NULL, a byte is then read from the word
+    // or written into it. reset and tick may be NULL, as may read16 for
+    // a device that is not fitted.
+    struct device {
+        uint32_t first, last;
+        uint16_t (*read16)(uint32_t a);
+        void (*write16)(uint32_t a, uint16_t v);
+        uint16_t (*read8)(uint32_t a);
+        void (*write8)(uint32_t a, uint16_t v);
+        void (*reset)();
+        uint8_t vector, priority;
+        uint8_t event;  // see event.h, event::N if none
+        void (*tick)();
+    };
+
+    // DEVICES lists the devices on the bus, one
+    // X(id, first, last, read16, write16, read8, write8, reset, vector, priority, event, tick)
+    // per device. unibus.cpp builds the device table and the I/O page
+    // dispatch table from it, so a new controller is an entry here, and
+    // an event in event.h if it schedules one. Devices are reset in
+    // this order.
+#define DEVICES(X) \
+    X(PSW,    0777776, 0777777, cpu::readreg, cpu::writereg, NULL, NULL, NULL,                0,    0, event::N,      NULL) \
+    X(SWR,    0777570, 0777571, cpu::readreg, cpu::writereg, NULL, NULL, NULL,                0,    0, event::N,      NULL) \
+    X(KW11,   0777546, 0777547, kw11::read16, kw11::write16, NULL, NULL, NULL,                0100, 6, event::CLOCK,  kw11::tick) \
+    X(TTI,    0777560, 0777563, cons::read16, cons::write16, NULL, NULL, cons::clearterminal, 060,  4, event::TTYIN,  cons::receive) \
+    X(TTO,    0777564, 0777567, cons::read16, cons::write16, NULL, NULL, NULL,                064,  4, event::TTYOUT, cons::transmit) \
+    X(RK11,   0777400, 0777417, rk11::read16, rk11::write16, NULL, NULL, rk11::reset,         0220, 5, event::RK,     rk11::done) \
+    X(MMUSR,  0777572, 0777577, mmu::read16,  mmu::write16,  NULL, NULL, NULL,                0,    0, event::N,      NULL) \
+    X(KPAGES, 0772300, 0772377, mmu::read16,  mmu::write16,  NULL, NULL, NULL,                0,    0, event::N,      NULL) \
+    X(UPAGES, 0777600, 0777677, mmu::read16,  mmu::write16,  NULL, NULL, NULL,                0,    0, event::N,      NULL) \
+    X(SR3,    0772516, 0772517, PDP1170 ? mmu::read16 : NULL, mmu::write16, NULL, NULL, NULL, 0,    0, event::N,      NULL) \
+    X(UBMAP,  0770200, 0770373, PDP1170 ? ubmapread : NULL,   ubmapwrite,   NULL, NULL, NULL, 0,    0, event::N,      NULL)
+
+#define DEVICEID(id, ...) id,
+    enum { DEVICES(DEVICEID) NDEVICES };
+#undef DEVICEID
+
+    // reset resets the devices, as RESET does.
+    void reset();
+
+    // interrupt posts the interrupt of device dev.
+    void interrupt(uint8_t dev);
+
+    // tick calls the handler of the device whose event ev is due.
+    void tick(uint8_t ev);
 };
 